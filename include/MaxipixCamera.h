@@ -103,6 +103,17 @@ public:
 	void getFillMode(MaxipixReconstruction::Type& type) const;
 	void setFillMode(MaxipixReconstruction::Type type);
 
+	void getReconstructionNbThreads(int& nb_threads) const;
+	void setReconstructionNbThreads(int nb_threads);
+
+	void getReconstructionBin(Bin& bin) const;
+	void setReconstructionBin(const Bin& bin);
+	void getReconstructionRoi(Roi& roi) const;
+	void setReconstructionRoi(const Roi& roi);
+
+	void getReconstructionFloatOutput(bool& float_output) const;
+	void setReconstructionFloatOutput(bool float_output);
+
 	void setEnergy(double energy) {m_mpxDacs->setEnergy(energy);m_mpxDacs->applyChipDacs(0); }
 	void getEnergy(double& energy){m_mpxDacs->getEnergy(energy); }
 
@@ -172,6 +183,10 @@ private:
 
 	MaxipixReconstruction::PositionList m_positions;
 	MaxipixReconstruction::Type m_reconstructType;
+	int m_reconstructNbThreads;
+	Bin m_reconstructBin;
+	Roi m_reconstructRoi;
+	bool m_reconstructFloat;
 	MaxipixReconstruction* m_reconstructionTask;
 
 	// Buffer management
@@ -174,6 +174,17 @@ public:
 	void getFillMode(MaxipixReconstruction::Type& type) {m_cam.getFillMode(type);}
 	void setFillMode(MaxipixReconstruction::Type type) {m_cam.setFillMode(type);}
 
+	void getReconstructionNbThreads(int& nb_threads) {m_cam.getReconstructionNbThreads(nb_threads);}
+	void setReconstructionNbThreads(int nb_threads) {m_cam.setReconstructionNbThreads(nb_threads);}
+
+	void getReconstructionBin(Bin& bin) {m_cam.getReconstructionBin(bin);}
+	void setReconstructionBin(const Bin& bin) {m_cam.setReconstructionBin(bin);}
+	void getReconstructionRoi(Roi& roi) {m_cam.getReconstructionRoi(roi);}
+	void setReconstructionRoi(const Roi& roi) {m_cam.setReconstructionRoi(roi);}
+
+	void getReconstructionFloatOutput(bool& float_output) {m_cam.getReconstructionFloatOutput(float_output);}
+	void setReconstructionFloatOutput(bool float_output) {m_cam.setReconstructionFloatOutput(float_output);}
+
 	void setEnergy(double energy){m_cam.setEnergy(energy);}
 	void getEnergy(double& energy){m_cam.getEnergy(energy);}
 
@@ -23,6 +23,7 @@
 #define MAXIPIXRECONSTRUCTION_H
 
 #include <list>
+#include <vector>
 #include "processlib/LinkTask.h"
 #include "lima/Constants.h"
 #include "lima/Debug.h"
@@ -53,7 +54,26 @@ public:
 		RAW, ZERO, DISPATCH, MEAN
 	};
 	enum Layout {
-		L_NONE, L_2x2, L_5x1, L_FREE, L_GENERAL
+		L_NONE, L_2x2, L_5x1, L_FREE, L_GENERAL, L_GRID
+	};
+	enum MaskFill {
+		MASK_ZERO, MASK_INTERPOLATE
+	};
+
+	/** @brief per phase latency of the processed frames, see getStats()
+	 */
+	struct Stats {
+		enum Phase {
+			ALLOC, COPY, GAP_FILL, CORRECTION, BINNING, COPY_BACK, TOTAL,
+			NB_PHASES
+		};
+		enum { NB_BINS = 32 };
+
+		bool enabled;
+		long long nb_frames;
+		long long total_ns[NB_PHASES];
+		long long max_ns[NB_PHASES];
+		long long histogram[NB_PHASES][NB_BINS];
 	};
 	explicit MaxipixReconstruction(Layout = L_NONE, Type = RAW);
 	MaxipixReconstruction(const MaxipixReconstruction&);
@@ -62,18 +82,177 @@ public:
 	void setType(Type);
 	void setXnYGapSpace(int xSpace, int ySpace);
 	void setChipsPosition(const PositionList&);
+	void setChipsGrid(int xChips, int yChips);
+	void getChipsGrid(int& xChips, int& yChips) const;
 	Size getImageSize() const;
 
+	void setNbThreads(int nb_threads);
+	int getNbThreads() const;
+
+	void setOutputBin(const Bin&);
+	Bin getOutputBin() const;
+	void setOutputRoi(const Roi&);
+	Roi getOutputRoi() const;
+
+	void setFlatField(const Data&);
+	void setPixelMask(const Data&);
+	void setMaskFill(MaskFill);
+	MaskFill getMaskFill() const;
+	void setHotPixelThreshold(int);
+	int getHotPixelThreshold() const;
+
+	void setFloatOutput(bool);
+	bool getFloatOutput() const;
+
+	void getStats(Stats&) const;
+	void resetStats();
+
 	virtual Data process(Data &aData);
+	Data processFrames(Data &aData, int nbFrames);
 
 private:
+	/** @brief placement of one chip, computed once from its Position
+	 *
+	 *  destination pixel (line,column) of the chip comes from raw pixel
+	 *  src_offset + line * line_step + column * pixel_step. nb_line by
+	 *  nb_column pixels are placed, the whole chip but for the lazy plan.
+	 */
+	struct ChipRemap {
+		RotationMode rotation;
+		int src_offset;
+		int dst_offset;
+		int line_step;
+		int pixel_step;
+		int nb_line;
+		int nb_column;
+	};
+	typedef std::vector<ChipRemap> RemapPlan;
+
+	/** @brief L_GENERAL in place: a chip line moved from the raw frame
+	 *  to the image (the same buffer), or through the chip buffer
+	 */
+	struct LineMove {
+		int src;
+		int dst;
+		bool from_chip;		// src in the chip buffer
+		bool to_chip;		// dst in the chip buffer
+	};
+	typedef std::vector<LineMove> LineMoves;
+	typedef std::vector<std::pair<int,int> > GapRuns; // offset,length
+
+	/** @brief L_GENERAL gap between two facing chip edges
+	 *
+	 *  nb_run parallel runs of nb_pixel gap pixels plus the two edge
+	 *  pixels. Pixel i of a run (0 and nb_pixel + 1 being the edges) is
+	 *  weights[2i] * first edge + weights[2i + 1] * last edge. step goes
+	 *  from one pixel of a run to the next, run_step from one run to the
+	 *  next, first is the first edge pixel of the first run.
+	 */
+	struct GapFill {
+		int first;
+		int step;
+		int run_step;
+		int nb_pixel;
+		int nb_run;
+		std::vector<float> weights;
+	};
+	typedef std::vector<GapFill> GapFills;
+
+	/** @brief a masked pixel and the pixels it is interpolated from
+	 *
+	 *  offsets in the reconstructed image, no neighbour with MASK_ZERO.
+	 */
+	struct MaskedPixel {
+		int offset;
+		int nb_neighbours;
+		int neighbours[4];
+	};
+	typedef std::vector<MaskedPixel> MaskedPixels;
+
+	/** @brief layout kernels, selected on configuration
+	 *
+	 *  5x1 does nbLine lines of nbChip chips from their first raw and
+	 *  image line, 2x2 works in place when a save buffer is given
+	 *  (otherwise only the chip tiles in roi are placed) and leaves the
+	 *  gaps to the Fill2x2 one.
+	 */
+	typedef void (*Kernel5x1)(void *src, void *dst, int nbChip,
+				  int xSpace, int nbLine);
+	typedef void (*Kernel2x2)(Data &src, void *dst, void *saved,
+				  int xSpace, int ySpace, const Roi &roi);
+	typedef void (*Fill2x2)(void *dst, int xSpace, int ySpace);
+
+	class _Job;
+	class _WorkerPool;
+	class _BufferPool;
+	template<class type> class _RemapJob;
+	class _Lines5x1Job;
+	class _CorrectJob;
+
 	Size _getImageSize(int, int, int, int) const;
+	Size _getFullImageSize() const;
+	bool _hasOutputStage() const;
+	bool _isLineLayout() const;
+	bool _is2x2Layout() const;
+	bool _isGeneralLayout() const;
+	Roi _getOutputRoi() const;
+	void _checkFrame(const Data&) const;
+	Data _process(Data&, Buffer *dst_buffer);
+	Data _reconstruct(Data&, bool inPlace, _BufferPool*,
+			  Buffer *dst_buffer = NULL, bool lazy = false);
+	Data _reduce(Data&, Buffer *dst_buffer = NULL);
+	Data _promoteRaw(Data&);
+	int _rawIndex(const Data&) const;
+	void _buildGridPositions();
+	void _buildRemapPlan();
+	void _buildLineMoves();
+	template<class type> void _remapInPlace(type *data, type *chip) const;
+	void _buildGapRuns(const PositionList&, GapRuns&) const;
+	void _buildKernelGapRuns();
+	void _buildGapFills();
+	void _addGapFill(int first,int step,int run_step,int nb_pixel,int nb_run);
+	void _buildLazyPlan();
+	void _checkCorrection();
+	void _buildMaskedPixels();
+	bool _hasPixelCorrection() const;
+	void _correct(Data&, const Roi&);
+	void _fixMaskedPixels(Data&);
+	void _runJob(_Job&, int nb_items);
+	void _selectKernels();
+	template<template<class> class Fill> void _setKernels();
 
 	Type m_type;
 	Layout m_layout;
 	int m_xgap;
 	int m_ygap;
+	int m_xchips;		// L_2x2, L_5x1 and L_GRID
+	int m_ychips;
 	PositionList m_chips_position;
+	RemapPlan m_remap_plan;
+	int m_remap_width;
+	LineMoves m_line_moves;		// empty: raw chips all copied aside
+	GapRuns m_gap_runs;
+	GapRuns m_kernel_gap_runs;	// L_2x2 and 5x1 pixels never written
+	GapFills m_gap_fills;
+	Roi m_lazy_roi;		// image part the output roi needs
+	RemapPlan m_lazy_plan;
+	GapFills m_lazy_fills;
+	Bin m_output_bin;
+	Roi m_output_roi;
+	std::vector<float> m_flat_field;
+	std::vector<unsigned char> m_pixel_mask;
+	MaskFill m_mask_fill;
+	int m_hot_pixel_threshold;
+	MaskedPixels m_masked_pixels;
+	bool m_float_output;
+	Kernel5x1 m_kernels_5x1[2][2];	// [float image][32 bits raw]
+	Kernel2x2 m_kernels_2x2[2][2];
+	Fill2x2 m_fills_2x2[2][2];
+	int m_nb_threads;
+	_WorkerPool* m_pool;
+	_BufferPool* m_buffers;
+	_BufferPool* m_scratch;	// in place work buffers
+	Stats m_stats;
 };
 
 inline std::ostream& operator <<(std::ostream& os, const MaxipixReconstruction::Position& p) {
@@ -23,6 +23,7 @@
 #define MPXCHIPCONFIG_H
 
 #include <vector>
+#include <map>
 #include <stdint.h>
 #include "lima/HwInterface.h"
 #include "PixelArray.h"
@@ -57,17 +58,38 @@ public:
 	void setLow2Min(int chipid);
 	void setHigh2Max(int chipid);
 	void setHigh2Min(int chipid);
+	void getVersion(Version& version);
+	void getNChips(int& nchip);
 private:
         MpxPixelConfig(const MpxPixelConfig& ctrl);
         MpxPixelConfig& operator=(const MpxPixelConfig& ctrl);
 
+	// identifies the content of a file without reading it
+	struct FileStamp {
+		uint64_t inode;
+		int64_t size;
+		int64_t mtime;
+		int64_t ctime;
+	};
+	// arrays of an already loaded file
+	struct FileArrays {
+		FileStamp stamp;
+		std::vector<uint8_t> arrays;
+	};
+
 	Version m_version;
 	int m_nchip;
 	std::string m_path;
 	std::string m_name;
 	std::vector<MpxPixelArray*> m_pixelArray;
-
-	std::string getConfigFile(const std::string& name, int chip);
+	// files of the last two loads only, to switch back and forth
+	// between two configs
+	std::map<std::string, FileArrays> m_fileCache;
+	std::vector<std::string> m_lastFiles;
+
+	void getConfigFiles(const std::string& name, std::vector<std::string>& files);
+	bool getFileStamp(const std::string& filename, FileStamp& stamp);
+	void trimFileCache(const std::vector<std::string>& files);
 };
 
 class MpxPixelArray {
@@ -95,6 +117,7 @@ public:
 	void setHigh2Min();
 
 private:
+	friend class MpxPixelConfig;
         MpxPixelArray(const MpxPixelArray& ctrl);
         MpxPixelArray& operator=(const MpxPixelArray& ctrl);
 
@@ -104,6 +127,9 @@ private:
 	std::string m_arrayLabels[4];
 	uint8_t m_arrayMask[4];
 	uint8_t m_arrayDepth[4];
+	std::string m_mpxString;
+	uint64_t m_mpxHash;
+	bool m_mpxDirty;
 
 	void setArrayValue(int index, uint8_t value);
 	uint8_t* getMaskArray();
@@ -121,6 +147,9 @@ private:
 	void resetLowArray();
 	void resetHighArray();
 	void resetArray(int index);
+	uint64_t contentHash();
+	void saveArrays(std::vector<uint8_t>& data);
+	void restoreArrays(const std::vector<uint8_t>& data);
 };
 
 } // namespace Maxipix
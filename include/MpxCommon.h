@@ -37,6 +37,9 @@ namespace Maxipix {
 
 bool checkPath(std::string path);
 
+const uint64_t CONTENT_HASH_SEED = 0xcbf29ce484222325ULL;
+uint64_t contentHash(const void* data, long size, uint64_t hash = CONTENT_HASH_SEED);
+
 const std::string convert_2_string(const Version& version);
 void convert_from_string(const std::string& val,Version& version);
 std::ostream& operator<<(std::ostream& os, Version& version);
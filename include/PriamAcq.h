@@ -24,6 +24,7 @@
 
 #include <string>
 #include <vector>
+#include <stdint.h>
 
 #include "lima/Debug.h"
 #include "lima/Exceptions.h"
@@ -105,6 +106,8 @@ class PriamAcq {
 
     void setChipFsr(short port,const std::string &fsr);
     void setChipCfg(short port,const std::string &cfg);
+    bool isChipCfgLoaded(short port,const std::string &cfg) const;
+    void invalidateChip(short port);
     
     void enableSerial(short port);
 
@@ -201,6 +204,7 @@ class PriamAcq {
     short			m_setup;
     Version	m_version;
     std::vector<long> 		m_chip_id;
+    std::vector<uint64_t>	m_chip_cfg_hash;
     std::string 	m_board_id;
     short			m_pcb; 
     short			m_firmware;
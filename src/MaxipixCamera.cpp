@@ -55,6 +55,8 @@ Camera::Camera(int espia_dev_nb, const std::string& config_path,
 	DEB_CONSTRUCTOR();
 	m_reconstructionTask = NULL;
 	m_reconstructType = MaxipixReconstruction::RAW;
+	m_reconstructNbThreads = 1;
+	m_reconstructFloat = false;
 	m_mpxDacs = NULL;
 	m_chipCfg = NULL;
 	init();
@@ -226,6 +228,7 @@ void Camera::getDetectorModel(std::string& type) {
 		break;
 	case MaxipixReconstruction::L_2x2:
 	case MaxipixReconstruction::L_5x1:
+	case MaxipixReconstruction::L_GRID:
 		ss << m_xchips << "x" << m_ychips << "(gap:" << m_xgap << "x" << m_ygap << ")-";
 		break;
 	case MaxipixReconstruction::L_FREE:
@@ -349,17 +352,48 @@ MaxipixReconstruction* Camera::createReconstructionTask() {
 	case MaxipixReconstruction::L_GENERAL:
 	        reconstruction = new MaxipixReconstruction(m_layout, m_reconstructType);
 		reconstruction->setChipsPosition(m_positions);
-		m_size = reconstruction->getImageSize();
 		break;
 	case MaxipixReconstruction::L_2x2:
 	case MaxipixReconstruction::L_5x1:
 	        reconstruction = new MaxipixReconstruction(m_layout, m_reconstructType);
 		reconstruction->setXnYGapSpace(m_xgap, m_ygap);
-		m_size = reconstruction->getImageSize();
+		break;
+	case MaxipixReconstruction::L_GRID:
+	        reconstruction = new MaxipixReconstruction(m_layout, m_reconstructType);
+		reconstruction->setXnYGapSpace(m_xgap, m_ygap);
+		reconstruction->setChipsGrid(m_xchips, m_ychips);
 		break;
 	default:
 		throw LIMA_HW_EXC(Error, "Unknown reconstruction model");
 	}
+	if (reconstruction != NULL) {
+		// frames are acquired with the full image size, the output
+		// roi and binning only change the images the task gives out
+		m_size = reconstruction->getImageSize();
+		reconstruction->setNbThreads(m_reconstructNbThreads);
+		// output stage once the geometry is set, the roi first as the
+		// bin is checked against it. The roi only reconstructs its part
+		// of the image, drop it if the new geometry doesn't fit it
+		try {
+			reconstruction->setOutputRoi(m_reconstructRoi);
+			reconstruction->setOutputBin(m_reconstructBin);
+		} catch (Exception& e) {
+			DEB_WARNING() << "Image size changed, reconstruction output "
+				      << DEB_VAR2(m_reconstructRoi, m_reconstructBin)
+				      << " removed";
+			m_reconstructRoi = Roi();
+			m_reconstructBin = Bin();
+			reconstruction->setOutputRoi(m_reconstructRoi);
+			reconstruction->setOutputBin(m_reconstructBin);
+		}
+		reconstruction->setFloatOutput(m_reconstructFloat);
+	}
+	// the acquisition buffers are sized from m_size
+	if (m_size.getWidth() * m_size.getHeight() < m_nchips * 256 * 256) {
+		delete reconstruction;
+		THROW_HW_ERROR(Error) << "Image smaller than the raw frame: "
+				      << DEB_VAR2(m_size, m_nchips);
+	}
 	// Update Size to CtImage
 	if (m_mis_cb_act) {
 		maxImageSizeChanged(m_size, m_type);
@@ -384,6 +418,67 @@ void Camera::setFillMode(MaxipixReconstruction::Type fillMode) {
 	}
 }
 
+void Camera::getReconstructionNbThreads(int& nb_threads) const {
+	nb_threads = m_reconstructNbThreads;
+}
+
+void Camera::setReconstructionNbThreads(int nb_threads) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(nb_threads);
+	if (nb_threads < 1)
+		THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR1(nb_threads);
+	m_reconstructNbThreads = nb_threads;
+	if (m_reconstructionTask != NULL) {
+		m_reconstructionTask->setNbThreads(nb_threads);
+	}
+}
+
+void Camera::getReconstructionBin(Bin& bin) const {
+	bin = m_reconstructBin;
+}
+
+// binning of the images out of the task, the acquired frames keep the
+// full image size (getImageSize)
+void Camera::setReconstructionBin(const Bin& bin) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(bin);
+	if (m_reconstructionTask != NULL) {
+		m_reconstructionTask->setOutputBin(bin);
+	}
+	m_reconstructBin = bin;
+}
+
+void Camera::getReconstructionRoi(Roi& roi) const {
+	roi = m_reconstructRoi;
+}
+
+// roi in reconstructed image coordinates, applied before the binning.
+// Only the part of the image it needs is reconstructed, the acquired
+// frames keep the full image size
+void Camera::setReconstructionRoi(const Roi& roi) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(roi);
+	if (m_reconstructionTask != NULL) {
+		m_reconstructionTask->setOutputRoi(roi);
+	}
+	m_reconstructRoi = roi;
+}
+
+void Camera::getReconstructionFloatOutput(bool& float_output) const {
+	float_output = m_reconstructFloat;
+}
+
+// float images out of the reconstruction task, the acquired frames
+// (m_type) stay Bpp16
+void Camera::setReconstructionFloatOutput(bool float_output) {
+	DEB_MEMBER_FUNCT();
+	DEB_PARAM() << DEB_VAR1(float_output);
+	if (m_reconstructionTask != NULL) {
+		m_reconstructionTask->setFloatOutput(float_output);
+	}
+	m_reconstructFloat = float_output;
+}
+
 void Camera::loadConfig(const std::string& name, bool reconstruction) {
 	DEB_MEMBER_FUNCT();
 //	thread.start_new_thread(Camera._loadConfig,(self,m_hwInt,name,reconstruction))
@@ -409,6 +504,11 @@ void Camera::loadDetConfig(const std::string& name, bool reconstruction) {
 	detConfig.loadConfig(name);
 	detConfig.getFilename(m_cfgFilename);
 	detConfig.getPriamPorts(m_priamPorts);
+	// chips may have been power cycled (same ID, no config): a config
+	// load always uploads the FSRs and pixel matrices
+	for (unsigned int idx = 0; idx < m_priamPorts.size(); idx++) {
+		m_priamAcq.invalidateChip(m_priamPorts[idx]);
+	}
 	detConfig.getDacs(m_mpxDacs);
 	detConfig.getPositionList(m_positions);
 	detConfig.getAsicType(m_version);
@@ -499,7 +599,21 @@ void Camera::setReconstructionActive(bool active) {
 
 void Camera::loadChipConfig(const std::string& name) {
 	DEB_MEMBER_FUNCT();
-	m_chipCfg = new MpxPixelConfig(m_version, m_nchips);
+	// keep the pixel config, and so its cache of loaded files, as long
+	// as the chips are the same
+	if (m_chipCfg != NULL) {
+		Version version;
+		int nchips;
+		m_chipCfg->getVersion(version);
+		m_chipCfg->getNChips(nchips);
+		if (version != m_version || nchips != m_nchips) {
+			delete m_chipCfg;
+			m_chipCfg = NULL;
+		}
+	}
+	if (m_chipCfg == NULL) {
+		m_chipCfg = new MpxPixelConfig(m_version, m_nchips);
+	}
 	m_chipCfg->setPath(m_cfgPath);
 	m_chipCfg->loadConfig(name);
 	applyPixelConfig(0);
@@ -509,10 +623,31 @@ void Camera::applyPixelConfig(int chipid) {
 	DEB_MEMBER_FUNCT();
 	std::string scfg;
 	if (chipid == 0) {
+		// only send the chips whose matrix differs from the last one
+		// written on their port. Before trusting that record, the FSR
+		// writes read back the chip IDs: a swapped chip loses its record
+		bool anyLoaded = false;
+		for (int idx = 0; idx < m_nchips && !anyLoaded; idx++) {
+			m_chipCfg->getMpxString(idx + 1, scfg);
+			anyLoaded = m_priamAcq.isChipCfgLoaded(m_priamPorts[idx], scfg);
+		}
+		if (anyLoaded && m_mpxDacs != NULL) {
+			m_mpxDacs->applyChipDacs(0);
+		}
+		int nbLoaded = 0;
 		for (int idx = 0; idx < m_nchips; idx++) {
 			m_chipCfg->getMpxString(idx + 1, scfg);
+			if (m_priamAcq.isChipCfgLoaded(m_priamPorts[idx], scfg)) {
+				std::cout << "Chip Config #" << (idx + 1) << " unchanged" << std::endl;
+				continue;
+			}
 			std::cout << "Loading Chip Config #" << (idx + 1) << " ..." << std::endl;
 			m_priamAcq.setChipCfg(m_priamPorts[idx], scfg);
+			nbLoaded++;
+		}
+		// nothing written, no pixel reset needed
+		if (nbLoaded == 0) {
+			return;
 		}
 	} else {
 		short port = getPriamPort(chipid);
@@ -19,563 +19,1221 @@
 // You should have received a copy of the GNU General Public License
 // along with this program; if not, see <http://www.gnu.org/licenses/>.
 //###########################################################################
+#include <algorithm>
+#include <new>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
 #include "MaxipixReconstruction.h"
+#include "MaxipixReconstructionKernels.h"
+#include "MaxipixReconstructionPool.h"
+#include "lima/ThreadUtils.h"
 
+using namespace lima;
 using namespace lima::Maxipix;
 
-static const int MAXIPIX_LINE_SIZE = 256 * 2;
-static const int MAXIPIX_NB_LINE = 256;
-static const int MAXIPIX_NB_COLUMN = 256;
+//----------------------------------------------------------------------------
+//			  intra-frame jobs
+//----------------------------------------------------------------------------
+static const int MAXIPIX_NB_LINE_PER_BAND = 16;
+
+/** @brief one item per chip of the remap plan
+ *
+ *  out of place each chip goes from src to dst. In place (L_FREE) each
+ *  chip is rotated in its own column.
+ */
+template<class type>
+class MaxipixReconstruction::_RemapJob : public _Job
+{
+public:
+  _RemapJob(const RemapPlan &aPlan,int aDstWidth,Data &aSrc,type *aDst,bool inPlace) :
+    m_plan(aPlan),m_dst_width(aDstWidth),m_src(aSrc),m_dst(aDst),m_in_place(inPlace) {}
+
+  virtual void run(int item)
+  {
+    const ChipRemap &aRemap = m_plan[item];
+    if(m_in_place)
+      _rotate_chip_in_place<type>(m_dst + aRemap.dst_offset,m_dst_width,
+				  aRemap.rotation);
+    else
+      _remap_chip<type>(((type*)m_src.data()) + aRemap.src_offset,
+			aRemap.line_step,aRemap.pixel_step,
+			m_dst + aRemap.dst_offset,m_dst_width,
+			aRemap.nb_line,aRemap.nb_column);
+  }
+private:
+  const RemapPlan& m_plan;
+  int m_dst_width;
+  Data& m_src;
+  type* m_dst;
+  bool m_in_place;
+};
+
+/** @brief one item per band of MAXIPIX_NB_LINE_PER_BAND lines of a 5x1 frame
+ *
+ *  (or single line L_GRID of nbChip chips). The pixel correction, if any,
+ *  is done on each band just written. Bands must be run from the last one
+ *  when in place.
+ */
+class MaxipixReconstruction::_Lines5x1Job : public _Job
+{
+public:
+  _Lines5x1Job(Kernel5x1 aKernel,Data &aSrc,Data &aDst,int nbChip,int xSpace,
+	       const float *aGain = NULL,int hotThreshold = 0) :
+    m_kernel(aKernel),m_src(aSrc),m_dst(aDst),m_nb_chip(nbChip),m_xgap(xSpace),
+    m_gain(aGain),m_hot_threshold(hotThreshold) {}
+
+  virtual void run(int item)
+  {
+    int aFirstLine = item * MAXIPIX_NB_LINE_PER_BAND;
+    int aFirstPixel = aFirstLine * m_dst.dimensions[0];
+    char *aDstPt = ((char*)m_dst.data()) + aFirstPixel * m_dst.depth();
+    m_kernel(((char*)m_src.data()) + aFirstLine * MAXIPIX_NB_COLUMN * m_nb_chip * m_src.depth(),
+	     aDstPt,m_nb_chip,m_xgap,MAXIPIX_NB_LINE_PER_BAND);
+    if(m_gain || m_hot_threshold > 0)
+      _correct_pixels(m_dst.type,aDstPt,m_gain ? m_gain + aFirstPixel : NULL,
+		      MAXIPIX_NB_LINE_PER_BAND * m_dst.dimensions[0],m_hot_threshold);
+  }
+private:
+  Kernel5x1 m_kernel;
+  Data& m_src;
+  Data& m_dst;
+  int m_nb_chip;
+  int m_xgap;
+  const float* m_gain;
+  int m_hot_threshold;
+};
+
+/** @brief hot pixels and flat field of a reconstructed frame
+ *
+ *  only in aRoi, one item per band of MAXIPIX_NB_LINE_PER_BAND lines.
+ *  Whole lines are done at once.
+ */
+class MaxipixReconstruction::_CorrectJob : public _Job
+{
+public:
+  _CorrectJob(Data &aData,const float *aGain,int hotThreshold,const Roi &aRoi) :
+    m_data(aData),m_gain(aGain),m_hot_threshold(hotThreshold),m_roi(aRoi) {}
+
+  virtual void run(int item)
+  {
+    int aWidth = m_data.dimensions[0];
+    Point aTopLeft = m_roi.getTopLeft();
+    Size aRoiSize = m_roi.getSize();
+    int aFirstLine = aTopLeft.y + item * MAXIPIX_NB_LINE_PER_BAND;
+    int aNbLine = std::min(MAXIPIX_NB_LINE_PER_BAND,
+			   aTopLeft.y + aRoiSize.getHeight() - aFirstLine);
+    int aNbPixel = aRoiSize.getWidth();
+    if(aNbPixel == aWidth)
+      aNbPixel *= aNbLine,aNbLine = 1;
+    for(int lineId = 0;lineId < aNbLine;++lineId)
+      {
+	int aFirstPixel = (aFirstLine + lineId) * aWidth + aTopLeft.x;
+	_correct_pixels(m_data.type,((char*)m_data.data()) + aFirstPixel * m_data.depth(),
+			m_gain ? m_gain + aFirstPixel : NULL,aNbPixel,
+			m_hot_threshold);
+      }
+  }
+private:
+  Data& m_data;
+  const float* m_gain;
+  int m_hot_threshold;
+  Roi m_roi;
+};
 
 //----------------------------------------------------------------------------
-//			  5x1 copy function
+//			  latency statistics
 //----------------------------------------------------------------------------
-#define COPY_5x1				\
-  int maxipix_line_size = MAXIPIX_LINE_SIZE;	\
-  int depth = src.depth();			\
-  if(depth == 4)				\
-    maxipix_line_size <<= 1;				\
-  /* set aSrcPt to the last line of the 5th chip */	\
-  unsigned char *aSrcPt = ((unsigned char*)src.data()) +		\
-			  (maxipix_line_size * 5 * MAXIPIX_NB_LINE) - maxipix_line_size; \
-  /*set aDstPt to the last line of the 5th chip including the gap */	\
-  unsigned char *aDstPt = ((unsigned char*)dst.data()) +		\
-			  ((maxipix_line_size * 5 + xSpace * depth * 4) * MAXIPIX_NB_LINE) - maxipix_line_size;	\
-									\
-  int aNbLine = MAXIPIX_NB_LINE;					\
-  do									\
-    {									\
-      int MAXIPIX_LINE_SIZE_COPY = maxipix_line_size;			\
-									\
-      int aNbChipCopyWithGap = 4;					\
-      do								\
-	{								\
-	  memmove(aDstPt,aSrcPt,MAXIPIX_LINE_SIZE_COPY);		\
-	  GAP_COPY_FUNCTION						\
-	  aDstPt -= maxipix_line_size + xSpace * depth;		        \
-	  aSrcPt -= maxipix_line_size;					\
-	}								\
-      while(--aNbChipCopyWithGap);					\
-      memmove(aDstPt,aSrcPt,MAXIPIX_LINE_SIZE_COPY);			\
-      aDstPt -= maxipix_line_size;					\
-      aSrcPt -= maxipix_line_size;					\
-    }									\
-while(--aNbLine);
-
-static void _raw_5x1(Data &src,Data &dst,
-		     int xSpace)
-{
-  if(src.depth() == 4)		// Accumulation
-    {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION			\
-      int *aPixel = ((int*)aDstPt) - 1;		\
-      for(int i = xSpace;i;--i,--aPixel)	\
-	*aPixel = 0;
-      COPY_5x1;
-    }
-  else
-    {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION					\
-      unsigned short *aPixel = ((unsigned short*)aDstPt) - 1;	\
-      for(int i = xSpace;i;--i,--aPixel)			\
-	*aPixel = 0;
-      COPY_5x1;
-    }
+// Built with MAXIPIX_RECONSTRUCTION_STATS, the time of each phase of a frame
+// is added to the task Stats with atomic operations (frames of the same
+// task can be processed at once by several threads). Otherwise the probes
+// below are empty and getStats() only gives zeros.
+#ifdef MAXIPIX_RECONSTRUCTION_STATS
+static inline long long _stats_now()
+{
+  struct timespec aTime;
+  clock_gettime(CLOCK_MONOTONIC,&aTime);
+  return aTime.tv_sec * 1000000000LL + aTime.tv_nsec;
 }
 
-static inline void _zero_5x1(Data &src,Data &dst,
-			     int xSpace)
+/** @brief add the phase started at aStart, returns the next phase start
+ */
+static inline long long _stats_record(MaxipixReconstruction::Stats &aStats,
+				      int aPhase,long long aStart)
 {
-  if(src.depth() == 4)
+  long long aNow = _stats_now();
+  long long aTime = aNow - aStart;
+  int aBin = aTime > 0 ? 63 - __builtin_clzll(aTime) : 0;
+  aBin = std::min(aBin,int(MaxipixReconstruction::Stats::NB_BINS) - 1);
+  __sync_fetch_and_add(&aStats.total_ns[aPhase],aTime);
+  __sync_fetch_and_add(&aStats.histogram[aPhase][aBin],1LL);
+  long long aMax = aStats.max_ns[aPhase];
+  while(aTime > aMax)
     {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION				\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 4;	\
-      int*aPixel = ((int*)aDstPt);			\
-      for(int i = xSpace + 2;i;--i,--aPixel)		\
-	*aPixel = 0;
-      COPY_5x1;
+      long long aPrevious = __sync_val_compare_and_swap(&aStats.max_ns[aPhase],aMax,aTime);
+      if(aPrevious == aMax)
+	break;
+      aMax = aPrevious;
     }
-  else
-    {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
+  return aNow;
+}
+
+#define STATS_START(aStart) long long aStart = _stats_now()
+#define STATS_RESET(aStart) aStart = _stats_now()
+#define STATS_PHASE(aPhase,aStart) aStart = _stats_record(m_stats,Stats::aPhase,aStart)
+#define STATS_FRAME(aStart)				\
+  __sync_fetch_and_add(&m_stats.nb_frames,1LL);		\
+  _stats_record(m_stats,Stats::TOTAL,aStart)
+#else
+#define STATS_START(aStart)
+#define STATS_RESET(aStart)
+#define STATS_PHASE(aPhase,aStart)
+#define STATS_FRAME(aStart)
 #endif
-#define GAP_COPY_FUNCTION					\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 2;		\
-      unsigned short *aPixel = ((unsigned short*)aDstPt);	\
-      for(int i = xSpace + 2;i;--i,--aPixel)			\
-	*aPixel = 0;
-      COPY_5x1;
-    }
+
+/** @brief the counters are written by the processing threads: read and
+ *  clear them one at a time with atomic operations too
+ */
+static inline long long _stats_read(const long long &aCounter)
+{
+  return __sync_fetch_and_add(const_cast<long long*>(&aCounter),0LL);
 }
-static inline void _dispatch_5x1(Data &src,Data &dst,
-				 int xSpace)
+
+static inline void _stats_clear(long long &aCounter)
 {
-  int nbPixelDispatch = (xSpace >> 1) + 1; // (xSpace / 2) + 1
-  if(src.depth() == 4)
-    {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION						\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 4;			\
-      int *aPixel = ((int*)aDstPt);					\
-      int aPixelValue = *aPixel / nbPixelDispatch;			\
-      for(int i = nbPixelDispatch;i;--i,--aPixel)			\
-	*aPixel = aPixelValue;						\
-									\
-      int *aSrcPixel = ((int*)aSrcPt) - 1;	\
-      aPixelValue = *aSrcPixel / nbPixelDispatch;			\
-      for(int i = nbPixelDispatch;i;--i,--aPixel)			\
-	*aPixel = aPixelValue; 
-      COPY_5x1;
-    }
-  else
+  __sync_fetch_and_and(&aCounter,0LL);
+}
+
+MaxipixReconstruction::MaxipixReconstruction(MaxipixReconstruction::Layout aLayout,
+					     MaxipixReconstruction::Type aType) :
+  m_type(aType),m_layout(aLayout),m_xgap(4),m_ygap(4),
+  m_xchips(aLayout == L_2x2 ? 2 : aLayout == L_5x1 ? 5 : 1),
+  m_ychips(aLayout == L_2x2 ? 2 : 1),m_remap_width(0),
+  m_mask_fill(MASK_ZERO),m_hot_pixel_threshold(0),m_float_output(false),
+  m_nb_threads(1),m_pool(NULL),m_buffers(new _BufferPool()),
+  m_scratch(new _BufferPool())
+{
+  _selectKernels();
+  resetStats();
+}
+
+MaxipixReconstruction::MaxipixReconstruction(const MaxipixReconstruction &other) :
+  LinkTask(other),m_type(other.m_type),m_layout(other.m_layout),
+  m_xgap(other.m_xgap),m_ygap(other.m_ygap),
+  m_xchips(other.m_xchips),m_ychips(other.m_ychips),
+  m_chips_position(other.m_chips_position),
+  m_remap_plan(other.m_remap_plan),m_remap_width(other.m_remap_width),
+  m_line_moves(other.m_line_moves),
+  m_gap_runs(other.m_gap_runs),m_gap_fills(other.m_gap_fills),
+  m_lazy_roi(other.m_lazy_roi),m_lazy_plan(other.m_lazy_plan),
+  m_lazy_fills(other.m_lazy_fills),
+  m_output_bin(other.m_output_bin),
+  m_output_roi(other.m_output_roi),m_flat_field(other.m_flat_field),
+  m_pixel_mask(other.m_pixel_mask),m_mask_fill(other.m_mask_fill),
+  m_hot_pixel_threshold(other.m_hot_pixel_threshold),
+  m_masked_pixels(other.m_masked_pixels),m_float_output(other.m_float_output),
+  m_nb_threads(1),m_pool(NULL),
+  m_buffers(new _BufferPool()),m_scratch(new _BufferPool())
+{
+  _selectKernels();
+  setNbThreads(other.m_nb_threads);
+  resetStats();
+}
+
+MaxipixReconstruction::~MaxipixReconstruction()
+{
+  delete m_pool;
+  m_buffers->release();
+  m_scratch->release();
+}
+
+void MaxipixReconstruction::setType(MaxipixReconstruction::Type aType)
+{
+  m_type = aType;
+  _selectKernels();
+  if(_isGeneralLayout() && !m_chips_position.empty())
+    _buildGapFills();
+  _buildLazyPlan();
+  m_buffers->clear();
+}
+
+template<template<class> class Fill>
+void MaxipixReconstruction::_setKernels()
+{
+  _select_5x1<unsigned short,Fill<unsigned short> >(m_xgap,m_kernels_5x1[0][0]);
+  _select_5x1<int,Fill<int> >(m_xgap,m_kernels_5x1[0][1]);
+  m_kernels_5x1[1][0] = _float_lines_5x1<unsigned short,Fill<float> >;
+  m_kernels_5x1[1][1] = _float_lines_5x1<int,Fill<float> >;
+  m_kernels_2x2[0][0] = _kernel_2x2<unsigned short,unsigned short>;
+  m_kernels_2x2[0][1] = _kernel_2x2<int,int>;
+  m_kernels_2x2[1][0] = _kernel_2x2<unsigned short,float>;
+  m_kernels_2x2[1][1] = _kernel_2x2<int,float>;
+  m_fills_2x2[0][0] = _fill_2x2<unsigned short,Fill<unsigned short> >;
+  m_fills_2x2[0][1] = _fill_2x2<int,Fill<int> >;
+  m_fills_2x2[1][0] = m_fills_2x2[1][1] = _fill_2x2<float,Fill<float> >;
+}
+
+/** @brief pick the layout kernels matching the fill type and the gaps
+ *
+ *  done on configuration so process() only chooses between the 16 and
+ *  32 bits kernels.
+ */
+void MaxipixReconstruction::_selectKernels()
+{
+  switch(m_type)
     {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION						\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 2;			\
-      unsigned short *aPixel = ((unsigned short*)aDstPt);		\
-      unsigned short aPixelValue = *aPixel / nbPixelDispatch;		\
-      for(int i = nbPixelDispatch;i;--i,--aPixel)			\
-	*aPixel = aPixelValue;						\
-									\
-      unsigned short *aSrcPixel = ((unsigned short*)aSrcPt) - 1;	\
-      aPixelValue = *aSrcPixel / nbPixelDispatch;			\
-      for(int i = nbPixelDispatch;i;--i,--aPixel)			\
-	*aPixel = aPixelValue; 
-      COPY_5x1;
+    case RAW:
+      _setKernels<RawFill>();break;
+    case ZERO:
+      _setKernels<ZeroFill>();break;
+    case DISPATCH:
+      _setKernels<DispatchFill>();break;
+    case MEAN:
+      _setKernels<MeanFill>();break;
+    default:			// ERROR
+      memset(m_kernels_5x1,0,sizeof(m_kernels_5x1));
+      memset(m_kernels_2x2,0,sizeof(m_kernels_2x2));
+      memset(m_fills_2x2,0,sizeof(m_fills_2x2));
+      break;
     }
+  _buildKernelGapRuns();
 }
 
-static inline void _mean_5x1(Data &src,Data &dst,
-			     int xSpace)
+/** @brief pixels the 5x1 and 2x2 kernels and fills never write
+ *
+ *  5x1 DISPATCH of odd gaps spreads the left edge pixel from the gap
+ *  side only (see DispatchFill::zone5x1()), the left chip last column
+ *  is left as it was. 2x2 MEAN and 2x2 DISPATCH of odd gaps leave a few
+ *  gap pixels, the whole gaps are listed, the fills write the others over
+ *  them. They are cleared on each frame in the recycled (or given) output
+ *  buffers, as the L_GENERAL gap runs.
+ */
+void MaxipixReconstruction::_buildKernelGapRuns()
 {
-  int nbPixelMean = (xSpace >> 1) + 1; // (xSpace / 2) + 1
-  if(src.depth() == 4)
+  m_kernel_gap_runs.clear();
+  if(_isLineLayout())
     {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION						\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 4;			\
-      int*aPixel = ((int*)aDstPt);					\
-      int aFirstPixelValue = *aPixel / nbPixelMean;			\
-      *aPixel = aFirstPixelValue;--aPixel;				\
-									\
-      int *aSrcPixel = ((int*)aSrcPt) - 1;				\
-      int aSecondPixelValue = *aSrcPixel / nbPixelMean;			\
-      float aStepValue = (aSecondPixelValue - aFirstPixelValue) / (xSpace + 1); \
-      float aPixelValue = aFirstPixelValue + aStepValue;		\
-      for(int i = xSpace + 1;i;--i,aPixelValue += aStepValue,--aPixel)	\
-	*aPixel = (int)aPixelValue;
-      COPY_5x1;
+      if(m_type != DISPATCH || !(m_xgap & 1))
+	return;
+      int aWidth = _getFullImageSize().getWidth();
+      for(int lineId = 0;lineId < MAXIPIX_NB_LINE;++lineId)
+	for(int chipId = 1;chipId < m_xchips;++chipId)
+	  m_kernel_gap_runs.push_back(std::make_pair(lineId * aWidth +
+						     chipId * (MAXIPIX_NB_COLUMN + m_xgap) -
+						     m_xgap - 1,1));
     }
-  else
+  else if(_is2x2Layout())
     {
-#ifdef GAP_COPY_FUNCTION
-#undef GAP_COPY_FUNCTION
-#endif
-#define GAP_COPY_FUNCTION						\
-      MAXIPIX_LINE_SIZE_COPY = maxipix_line_size - 2;			\
-      unsigned short *aPixel = ((unsigned short*)aDstPt);		\
-      unsigned short aFirstPixelValue = *aPixel / nbPixelMean;		\
-      *aPixel = aFirstPixelValue;--aPixel;				\
-									\
-      unsigned short *aSrcPixel = ((unsigned short*)aSrcPt) - 1;	\
-      unsigned short aSecondPixelValue = *aSrcPixel / nbPixelMean;	\
-      float aStepValue = (aSecondPixelValue - aFirstPixelValue) / (xSpace + 1); \
-      float aPixelValue = aFirstPixelValue + aStepValue;		\
-      for(int i = xSpace + 1;i;--i,aPixelValue += aStepValue,--aPixel)	\
-	*aPixel = (unsigned short)aPixelValue;
-      COPY_5x1;
+      if(m_type != MEAN && (m_type != DISPATCH || !((m_xgap | m_ygap) & 1)))
+	return;
+      PositionList aPositions;
+      for(int chipId = 0;chipId < 4;++chipId)
+	{
+	  Position aPosition;
+	  aPosition.origin = Point(chipId % 2 * (MAXIPIX_NB_COLUMN + m_xgap),
+				   chipId / 2 * (MAXIPIX_NB_LINE + m_ygap));
+	  aPosition.rotation = Rotation_0;
+	  aPositions.push_back(aPosition);
+	}
+      _buildGapRuns(aPositions,m_kernel_gap_runs);
     }
 }
-//----------------------------------------------------------------------------
-//			     2x2 function
-//----------------------------------------------------------------------------
-template<class type>
-static inline void copy_2x2(Data &src,Buffer *dst,int xSpace,int ySpace)
+
+/** @brief number of threads used to reconstruct one frame
+ *
+ *  1 (default) reconstructs in the calling thread only, n > 1 starts n - 1
+ *  persistent workers which share chips or line bands with the caller.
+ *  Must not be called while process() runs.
+ */
+void MaxipixReconstruction::setNbThreads(int nb_threads)
 {
-  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
-  int aTotalHeight = (MAXIPIX_NB_LINE * 2) + ySpace;
-  type *aSrcPt = (type*)src.data();
-  type *aDstPt = ((type*)dst->data) + (aTotalWidth * aTotalHeight) - aTotalWidth;
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR1(nb_threads);
 
-  int aJump2LeftChip = aTotalWidth - 1;
-  
-  int aColumnIterNumber = MAXIPIX_NB_COLUMN;
-  do
-    {
-      //copy left chips
-      for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt -= aTotalWidth,++aSrcPt)
-	*aDstPt = *aSrcPt;
- 
-      aDstPt -= aTotalWidth * ySpace;
-      
-      for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt -= aTotalWidth,++aSrcPt)
-	*aDstPt = *aSrcPt;
- 
-      aDstPt += aJump2LeftChip + aTotalWidth;
-      --aJump2LeftChip;
-      //copy right chips
-      for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth,++aSrcPt)
-	*aDstPt = *aSrcPt;
+  if(nb_threads < 1)
+    THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR1(nb_threads);
+  if(nb_threads == m_nb_threads)
+    return;
 
-      aDstPt += aTotalWidth * ySpace;
+  delete m_pool;
+  m_pool = NULL;
+  m_nb_threads = nb_threads;
+  if(m_nb_threads > 1)
+    m_pool = new _WorkerPool(m_nb_threads - 1);
+}
 
-      for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth,++aSrcPt)
-	*aDstPt = *aSrcPt;
+int MaxipixReconstruction::getNbThreads() const
+{
+  return m_nb_threads;
+}
 
-      aDstPt -= aJump2LeftChip + aTotalWidth;
-      --aJump2LeftChip;
-    }
-  while(--aColumnIterNumber);
+void MaxipixReconstruction::_runJob(_Job &aJob,int nb_items)
+{
+  if(m_pool)
+    m_pool->run(aJob,nb_items);
+  else
+    for(int i = 0;i < nb_items;++i)
+      aJob.run(i);
+}
 
+void MaxipixReconstruction::setXnYGapSpace(int xSpace,int ySpace)
+{
+  m_xgap = xSpace,m_ygap = ySpace;
+  _selectKernels();
+  if(m_layout == L_GRID)
+    _buildGridPositions();
+  _buildLazyPlan();
+  _checkCorrection();
+  m_buffers->clear();
 }
 
-template<class type>
-static inline void _raw_2x2(Data &src,Buffer *dst,int xSpace,int ySpace)
+
+void MaxipixReconstruction::setChipsPosition(const MaxipixReconstruction::PositionList& pList)
+{
+  m_chips_position = pList;
+  _buildRemapPlan();
+  _buildLazyPlan();
+  _checkCorrection();
+  m_buffers->clear();
+}
+
+/** @brief regular grid of xChips by yChips chips, L_GRID layout only
+ *
+ *  raw chips are read line by line from the top left one, none rotated.
+ *  A single line (2x1, 3x1...) is reconstructed by the 5x1 line kernels,
+ *  a 2x2 grid by the L_2x2 ones, other grids of several lines by the
+ *  L_GENERAL chip remap and gap fills. The gaps are
+ *  given by setXnYGapSpace().
+ */
+void MaxipixReconstruction::setChipsGrid(int xChips,int yChips)
 {
-  copy_2x2<type>(src,dst,xSpace,ySpace);
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR2(xChips,yChips);
 
-  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
-  type *aDstPt = ((type*)dst->data) + MAXIPIX_NB_COLUMN;
-  for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth)
-    for(int k = 0;k < xSpace;++k)
-      aDstPt[k] = 0;
-  
-  aDstPt -= MAXIPIX_NB_COLUMN;
-  int aGapSize = aTotalWidth * ySpace;
-  memset(aDstPt,0,aGapSize * sizeof(type));
-  aDstPt += aGapSize;
+  if(m_layout != L_GRID)
+    THROW_HW_ERROR(NotSupported) << "Chips grid only for L_GRID layout";
+  if(xChips < 1 || yChips < 1)
+    THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR2(xChips,yChips);
 
-  aDstPt += MAXIPIX_NB_COLUMN;
-  for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth)
-    for(int k = 0;k < xSpace;++k)
-      aDstPt[k] = 0;
+  m_xchips = xChips,m_ychips = yChips;
+  _buildGridPositions();
+  _buildKernelGapRuns();
+  _buildLazyPlan();
+  _checkCorrection();
+  m_buffers->clear();
 }
 
-template<class type>
-static inline void _zero_2x2(Data &src,Buffer *dst,int xSpace,int ySpace)
-{
-  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
-  copy_2x2<type>(src,dst,xSpace,ySpace);
-  
-  type *aDstPt = ((type*)dst->data) + MAXIPIX_NB_COLUMN - 1;
-  for(int i = MAXIPIX_NB_LINE - 1;i;--i,aDstPt += aTotalWidth)
-    for(int k = 0;k < xSpace + 2;++k)
-      aDstPt[k] = 0;
-  
-  aDstPt -= MAXIPIX_NB_COLUMN - 1;
-  int aGapSize = aTotalWidth * (ySpace + 2);
-  memset(aDstPt,0,aGapSize * sizeof(type));
-  aDstPt += aGapSize;
-
-  aDstPt += MAXIPIX_NB_COLUMN - 1;
-  for(int i = MAXIPIX_NB_LINE - 1;i;--i,aDstPt += aTotalWidth)
-    for(int k = 0;k < xSpace + 2;++k)
-      aDstPt[k] = 0;
+void MaxipixReconstruction::getChipsGrid(int &xChips,int &yChips) const
+{
+  xChips = m_xchips,yChips = m_ychips;
 }
 
-template<class type>
-static inline void _dispatch_2x2(Data &src,Buffer *dst,int xSpace,int ySpace)
-{
-  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
-  copy_2x2<type>(src,dst,xSpace,ySpace);
-  
-  type *aDstPt = ((type*)dst->data) + MAXIPIX_NB_COLUMN - 1;
-  int aNbPixel2Dispatch = (xSpace >> 1) + 1;
-
-  for(int lineId = MAXIPIX_NB_LINE - 1;lineId;--lineId)
-    {
-      type aPixelValue = *aDstPt / aNbPixel2Dispatch;
-      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
-	*aDstPt = aPixelValue;
-
-      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / aNbPixel2Dispatch;
-      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
-	*aDstPt = aPixelValue;
-  
-      aDstPt += aTotalWidth - (xSpace + 2);
-    }
-  
-
-  aDstPt -= MAXIPIX_NB_COLUMN - 1;
-  int aNbPixel2DispatchInY = (ySpace >> 1) + 1;
-  
-  int aPart = 2;
-  /* aPart == 2 => upper chip
-     aPart == 1 => bottom chip
-  */
-  do
-    {
-      type aPixelValue;
-      //Last line or first line of left chip (depend on aPart)
-      for(int columnIter = MAXIPIX_NB_COLUMN - 1;columnIter;--columnIter,++aDstPt)
-	{
-	  aPixelValue = *aDstPt / aNbPixel2DispatchInY;
-	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
-	    aDstPt[aTotalWidth * y] = aPixelValue;
-	}
-  
-      //Bottom or top right corner of left chip
-      aPixelValue = *aDstPt / (aNbPixel2DispatchInY * aNbPixel2Dispatch);
-      for(int columnIter = aNbPixel2Dispatch;columnIter;--columnIter,++aDstPt)
+/** @brief L_5x1 or a L_GRID of a single line, done by the 5x1 line kernels
+ */
+bool MaxipixReconstruction::_isLineLayout() const
+{
+  return m_layout == L_5x1 || (m_layout == L_GRID && m_ychips == 1);
+}
+
+/** @brief L_2x2 or a 2x2 L_GRID, done by the 2x2 kernels and fills
+ */
+bool MaxipixReconstruction::_is2x2Layout() const
+{
+  return m_layout == L_2x2 ||
+    (m_layout == L_GRID && m_xchips == 2 && m_ychips == 2);
+}
+
+/** @brief L_GENERAL or any other L_GRID of several lines, placed by the
+ *  remap plan
+ */
+bool MaxipixReconstruction::_isGeneralLayout() const
+{
+  return m_layout == L_GENERAL ||
+    (m_layout == L_GRID && m_ychips > 1 && !_is2x2Layout());
+}
+
+/** @brief chips position of a L_GRID, none for a single line or 2x2 grid
+ */
+void MaxipixReconstruction::_buildGridPositions()
+{
+  m_chips_position.clear();
+  if(_isGeneralLayout())
+    for(int chipId = 0;chipId < m_xchips * m_ychips;++chipId)
+      {
+	Position aPosition;
+	aPosition.origin = Point(chipId % m_xchips * (MAXIPIX_NB_COLUMN + m_xgap),
+				 chipId / m_xchips * (MAXIPIX_NB_LINE + m_ygap));
+	aPosition.rotation = Rotation_0;
+	m_chips_position.push_back(aPosition);
+      }
+  _buildRemapPlan();
+}
+
+/** @brief compute the chips placement for L_FREE and L_GENERAL layout
+ *
+ *  raw chips are side by side in the acquired frame. For L_FREE each chip
+ *  stays in its own column, for L_GENERAL (and L_GRID) it goes to its
+ *  origin in an image of _getFullImageSize() width.
+ */
+void MaxipixReconstruction::_buildRemapPlan()
+{
+  m_remap_plan.clear();
+  m_line_moves.clear();
+  m_gap_runs.clear();
+  m_gap_fills.clear();
+  if((m_layout != L_FREE && !_isGeneralLayout()) ||
+     m_chips_position.empty())
+    return;
+
+  int nb_chips = m_chips_position.size();
+  int src_stride = nb_chips * MAXIPIX_NB_COLUMN;
+  m_remap_width = m_layout == L_FREE ? src_stride : _getFullImageSize().getWidth();
+  int chip_id = 0;
+  for(PositionList::const_iterator chip_iter = m_chips_position.begin();
+      chip_iter != m_chips_position.end();++chip_iter,++chip_id)
+    {
+      ChipRemap aRemap;
+      int first;
+      aRemap.rotation = chip_iter->rotation;
+      _remap_steps(aRemap.rotation,src_stride,first,aRemap.line_step,aRemap.pixel_step);
+      aRemap.src_offset = chip_id * MAXIPIX_NB_COLUMN + first;
+      aRemap.nb_line = MAXIPIX_NB_LINE,aRemap.nb_column = MAXIPIX_NB_COLUMN;
+      if(m_layout == L_FREE)
+	aRemap.dst_offset = chip_id * MAXIPIX_NB_COLUMN;
+      else
+	aRemap.dst_offset = chip_iter->origin.y * m_remap_width + chip_iter->origin.x;
+      m_remap_plan.push_back(aRemap);
+    }
+
+  if(_isGeneralLayout())
+    {
+      _buildGapRuns(m_chips_position,m_gap_runs);
+      _buildGapFills();
+      _buildLineMoves();
+    }
+}
+
+/** @brief chip line moves building the L_GENERAL image in the raw frame
+ *
+ *  in place, each chip is first rotated in its own raw column (as L_FREE)
+ *  so that its raw lines are its image lines. A line is then moved to the
+ *  image once the raw lines its image place covers (but its own, memmove)
+ *  are moved or saved. When every line left waits for another one, a line
+ *  is saved in the chip buffer, at most one chip, and moved from there
+ *  later. If that is not enough, or if chips overlap in the image, no
+ *  move is planned and all the raw chips are copied aside.
+ */
+void MaxipixReconstruction::_buildLineMoves()
+{
+  for(PositionList::const_iterator i = m_chips_position.begin();
+      i != m_chips_position.end();++i)
+    for(PositionList::const_iterator j = i;++j != m_chips_position.end();)
+      if(abs(i->origin.x - j->origin.x) < MAXIPIX_NB_COLUMN &&
+	 abs(i->origin.y - j->origin.y) < MAXIPIX_NB_LINE)
+	return;
+
+  // raw line l of chip c is line l * nb_chips + c, the raw frame is made
+  // of MAXIPIX_NB_COLUMN pixel lines one after the other
+  int nb_chips = m_remap_plan.size();
+  int nb_lines = nb_chips * MAXIPIX_NB_LINE;
+  std::vector<int> aDst(nb_lines);
+  std::vector<int> aNbWait(nb_lines,0);
+  std::vector<std::vector<int> > aWaiters(nb_lines);
+  for(int lineId = 0;lineId < nb_lines;++lineId)
+    {
+      const ChipRemap &aRemap = m_remap_plan[lineId % nb_chips];
+      aDst[lineId] = aRemap.dst_offset + lineId / nb_chips * m_remap_width;
+      int aFirst = aDst[lineId] / MAXIPIX_NB_COLUMN;
+      int aLast = (aDst[lineId] + MAXIPIX_NB_COLUMN - 1) / MAXIPIX_NB_COLUMN;
+      for(int aCovered = aFirst;aCovered <= aLast && aCovered < nb_lines;++aCovered)
+	if(aCovered != lineId)
+	  {
+	    ++aNbWait[lineId];
+	    aWaiters[aCovered].push_back(lineId);
+	  }
+    }
+
+  std::vector<int> aReady;
+  for(int lineId = 0;lineId < nb_lines;++lineId)
+    if(!aNbWait[lineId])
+      aReady.push_back(lineId);
+  std::vector<bool> aReleased(nb_lines,false);	// moved or saved
+  std::vector<int> aSlot(nb_lines,-1);
+  std::vector<int> aFreeSlots;
+  for(int slot = MAXIPIX_NB_LINE - 1;slot >= 0;--slot)
+    aFreeSlots.push_back(slot);
+
+  for(int aNbMoved = 0;aNbMoved < nb_lines;)
+    {
+      LineMove aMove;
+      int aReleasedLine;
+      if(!aReady.empty())
 	{
-	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
-	    aDstPt[aTotalWidth * y] = aPixelValue;
+	  int lineId = aReady.back();
+	  aReady.pop_back();
+	  aMove.from_chip = aSlot[lineId] >= 0,aMove.to_chip = false;
+	  aMove.src = aMove.from_chip ? aSlot[lineId] * MAXIPIX_NB_COLUMN :
+	    lineId * MAXIPIX_NB_COLUMN;
+	  aMove.dst = aDst[lineId];
+	  if(aMove.from_chip)
+	    aFreeSlots.push_back(aSlot[lineId]);
+	  ++aNbMoved;
+	  aReleasedLine = aReleased[lineId] ? -1 : lineId;
 	}
-      //Bottom or top left corner of right chip
-      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / (aNbPixel2DispatchInY * aNbPixel2Dispatch);
-      for(int columnIter = aNbPixel2Dispatch;columnIter;--columnIter,++aDstPt)
+      else
 	{
-	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
-	    aDstPt[aTotalWidth * y] = aPixelValue;
+	  // every line left waits: save the one that frees the most lines
+	  aReleasedLine = -1;
+	  int aBestCount = 0;
+	  for(int lineId = 0;lineId < nb_lines;++lineId)
+	    {
+	      if(aReleased[lineId])
+		continue;
+	      int aCount = 0;
+	      for(std::vector<int>::iterator w = aWaiters[lineId].begin();
+		  w != aWaiters[lineId].end();++w)
+		aCount += aNbWait[*w] == 1;
+	      if(aCount > aBestCount)
+		aBestCount = aCount,aReleasedLine = lineId;
+	    }
+	  if(aReleasedLine < 0 || aFreeSlots.empty())
+	    {
+	      m_line_moves.clear();
+	      return;
+	    }
+	  aSlot[aReleasedLine] = aFreeSlots.back();
+	  aFreeSlots.pop_back();
+	  aMove.from_chip = false,aMove.to_chip = true;
+	  aMove.src = aReleasedLine * MAXIPIX_NB_COLUMN;
+	  aMove.dst = aSlot[aReleasedLine] * MAXIPIX_NB_COLUMN;
 	}
-      //Last or first line of right chip
-      for(int columnIter = MAXIPIX_NB_COLUMN - 1;columnIter;--columnIter,++aDstPt)
+      m_line_moves.push_back(aMove);
+
+      if(aReleasedLine >= 0)
 	{
-	  aPixelValue = *aDstPt / aNbPixel2DispatchInY;
-	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
-	    aDstPt[aTotalWidth * y] = aPixelValue;
+	  aReleased[aReleasedLine] = true;
+	  std::vector<int> &aLineWaiters = aWaiters[aReleasedLine];
+	  for(std::vector<int>::iterator w = aLineWaiters.begin();w != aLineWaiters.end();++w)
+	    if(!--aNbWait[*w])
+	      aReady.push_back(*w);
 	}
-      
-      //Set Variable for second part iteration (bottom chip)
-      aDstPt += aTotalWidth * ySpace;
-      aTotalWidth = -aTotalWidth;
     }
-  while(--aPart);
+}
+
+/** @brief build the L_GENERAL image in the raw frame, see _buildLineMoves()
+ */
+template<class type>
+void MaxipixReconstruction::_remapInPlace(type *aData,type *aChip) const
+{
+  int aSrcStride = m_remap_plan.size() * MAXIPIX_NB_COLUMN;
+  for(unsigned int chipId = 0;chipId < m_remap_plan.size();++chipId)
+    _rotate_chip_in_place<type>(aData + chipId * MAXIPIX_NB_COLUMN,aSrcStride,
+				m_remap_plan[chipId].rotation);
+  for(LineMoves::const_iterator i = m_line_moves.begin();i != m_line_moves.end();++i)
+    memmove((i->to_chip ? aChip : aData) + i->dst,
+	    (i->from_chip ? aChip : aData) + i->src,
+	    MAXIPIX_NB_COLUMN * sizeof(type));
+}
 
-  aDstPt = ((type*)dst->data) + aTotalWidth * (MAXIPIX_NB_LINE + ySpace + 1) +
-    MAXIPIX_NB_COLUMN - 1;
-  
-  for(int lineId = MAXIPIX_NB_LINE - 1;lineId;--lineId)
+/** @brief list the image pixels no chip of pList covers
+ *
+ *  they are the only ones to clear on each frame. Runs are in pixel,
+ *  contiguous runs of consecutive lines are merged.
+ */
+void MaxipixReconstruction::_buildGapRuns(const PositionList &pList,GapRuns &aRuns) const
+{
+  aRuns.clear();
+  Size aSize = _getFullImageSize();
+  int aWidth = aSize.getWidth();
+  for(int lineId = 0;lineId < aSize.getHeight();++lineId)
     {
-      type aPixelValue = *aDstPt / aNbPixel2Dispatch;
-      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
-	*aDstPt = aPixelValue;
+      std::vector<std::pair<int,int> > aChipRuns;
+      for(PositionList::const_iterator chip_iter = pList.begin();
+	  chip_iter != pList.end();++chip_iter)
+	if(lineId >= chip_iter->origin.y && lineId < chip_iter->origin.y + MAXIPIX_NB_LINE)
+	  aChipRuns.push_back(std::make_pair(chip_iter->origin.x,
+					     chip_iter->origin.x + MAXIPIX_NB_COLUMN));
+      std::sort(aChipRuns.begin(),aChipRuns.end());
+      aChipRuns.push_back(std::make_pair(aWidth,aWidth));
 
-      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / aNbPixel2Dispatch;
-      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
-	*aDstPt = aPixelValue;
-  
-      aDstPt += aTotalWidth - (xSpace + 2);
+      int aColumn = 0;
+      for(std::vector<std::pair<int,int> >::iterator i = aChipRuns.begin();
+	  i != aChipRuns.end();++i)
+	{
+	  if(i->first > aColumn)
+	    {
+	      int anOffset = lineId * aWidth + aColumn;
+	      int aLength = i->first - aColumn;
+	      if(!aRuns.empty() &&
+		 aRuns.back().first + aRuns.back().second == anOffset)
+		aRuns.back().second += aLength;
+	      else
+		aRuns.push_back(std::make_pair(anOffset,aLength));
+	    }
+	  aColumn = std::max(aColumn,i->second);
+	}
     }
 }
 
-template<class type>
-static inline void _mean_2x2(Data &src,Buffer *dst,int xSpace,int ySpace)
-{
-  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
-  copy_2x2<type>(src,dst,xSpace,ySpace);
-  type *aDstPt = ((type*)dst->data) + MAXIPIX_NB_COLUMN - 1;
-  int aNbXPixel2Dispatch = (xSpace >> 1) + 1;
-  int aNbYPixel2Dispatch = (ySpace >> 1) + 1;
-
-  for(int aLineIter = MAXIPIX_NB_LINE - 1;aLineIter;--aLineIter,aDstPt += aTotalWidth)
-    {
-      float aFirstValue = *aDstPt / float(aNbXPixel2Dispatch);
-      float aLastValue = aDstPt[xSpace + 1] / float(aNbXPixel2Dispatch);
-      float anInc = (aLastValue - aFirstValue) / (xSpace + 1);
-      *aDstPt = (type)aFirstValue;
-      aDstPt[xSpace + 1] = (type)aLastValue;
-      aFirstValue += anInc;
-
-      for(int i = 0;i < xSpace;++i,aFirstValue += anInc)
-	aDstPt[1 + i] = (type)aFirstValue;
-    }
-
-  //corner
-  int aNbPixel2Dispatch = aNbXPixel2Dispatch + aNbYPixel2Dispatch;
-  float a1ftCornerValue = *aDstPt / float(aNbPixel2Dispatch);
-  float a2ndCornerValue = aDstPt[xSpace + 1] / float(aNbPixel2Dispatch);
-  float a3thCornerValue = aDstPt[(ySpace + 1) * aTotalWidth]  / float(aNbPixel2Dispatch);
-  float a4thCornerValue = aDstPt[(ySpace + 1) * aTotalWidth + xSpace + 1] / float(aNbPixel2Dispatch);
-  
-  float *aFirstLinePt = new float[xSpace +2];
-  aFirstLinePt[0] = a1ftCornerValue;
-  aFirstLinePt[xSpace + 1] = a2ndCornerValue;
-  float anInc = (a2ndCornerValue - a1ftCornerValue) / (xSpace + 1);
-  for(int i = 0;i < xSpace;++i)
-    aFirstLinePt[i + 1] = aFirstLinePt[i] + anInc;
-
-  float *aLastLinePt = new float[xSpace + 2];
-  aLastLinePt[0] = a3thCornerValue;
-  aLastLinePt[xSpace + 1] = a4thCornerValue;
-  anInc = (a4thCornerValue - a3thCornerValue) / (xSpace + 1);
-  for(int i = 0;i < xSpace;++i)
-    aLastLinePt[i + 1] = aLastLinePt[i] + anInc;
-  
-  float *anIncBuffer = new float[xSpace + 2];
-  for(int i = 0;i < xSpace + 2;++i)
-    anIncBuffer[i] = (aLastLinePt[i] - aFirstLinePt[i]) / (ySpace + 1);
-  
-  
-  for(int lineIter = ySpace + 1;lineIter;--lineIter,aDstPt += aTotalWidth)
-    {
-      for(int colId = 0;colId < xSpace + 2;++colId)
+/** @brief find the L_GENERAL gaps to interpolate (all but RAW type)
+ *
+ *  a gap lies between two chips facing each other, on the lines (or
+ *  columns) they share, with no other chip in between. Horizontal gaps
+ *  come first, vertical ones then spread the already dispatched corner
+ *  pixels. Pixels between diagonal chips are not filled.
+ *
+ *  L_GRID gaps are filled as the 2x2 ones: empty gaps too (their edges),
+ *  and vertical gaps go across the whole image so the gap crossings are
+ *  filled from the horizontal gaps above and below.
+ */
+void MaxipixReconstruction::_buildGapFills()
+{
+  m_gap_fills.clear();
+  if(m_type == RAW)
+    return;
+
+  int aWidth = _getFullImageSize().getWidth();
+  if(m_layout == L_GRID)
+    {
+      for(int lineId = 0;lineId < m_ychips;++lineId)
+	for(int columnId = 1;columnId < m_xchips;++columnId)
+	  _addGapFill(lineId * (MAXIPIX_NB_LINE + m_ygap) * aWidth +
+		      columnId * (MAXIPIX_NB_COLUMN + m_xgap) - m_xgap - 1,
+		      1,aWidth,m_xgap,MAXIPIX_NB_LINE);
+      for(int lineId = 1;lineId < m_ychips;++lineId)
+	_addGapFill((lineId * (MAXIPIX_NB_LINE + m_ygap) - m_ygap - 1) * aWidth,
+		    aWidth,1,m_ygap,aWidth);
+      return;
+    }
+  for(int vertical = 0;vertical < 2;++vertical)
+    for(PositionList::const_iterator a = m_chips_position.begin();
+	a != m_chips_position.end();++a)
+      for(PositionList::const_iterator b = m_chips_position.begin();
+	  b != m_chips_position.end();++b)
 	{
-	  aDstPt[colId] = (type)aFirstLinePt[colId];
-	  aFirstLinePt[colId] += anIncBuffer[colId];
+	  int aAlong = vertical ? a->origin.y : a->origin.x;
+	  int aAcross = vertical ? a->origin.x : a->origin.y;
+	  int bAlong = vertical ? b->origin.y : b->origin.x;
+	  int bAcross = vertical ? b->origin.x : b->origin.y;
+	  int aGapStart = aAlong + MAXIPIX_NB_COLUMN;
+	  int aFrom = std::max(aAcross,bAcross);
+	  int aTo = std::min(aAcross,bAcross) + MAXIPIX_NB_COLUMN;
+	  if(bAlong <= aGapStart || aFrom >= aTo)
+	    continue;
+
+	  bool aFree = true;
+	  for(PositionList::const_iterator c = m_chips_position.begin();
+	      aFree && c != m_chips_position.end();++c)
+	    {
+	      int cAlong = vertical ? c->origin.y : c->origin.x;
+	      int cAcross = vertical ? c->origin.x : c->origin.y;
+	      aFree = cAlong >= bAlong || cAlong + MAXIPIX_NB_COLUMN <= aGapStart ||
+		cAcross >= aTo || cAcross + MAXIPIX_NB_COLUMN <= aFrom;
+	    }
+	  if(!aFree)
+	    continue;
+
+	  if(vertical)
+	    _addGapFill((aGapStart - 1) * aWidth + aFrom,aWidth,1,
+			bAlong - aGapStart,aTo - aFrom);
+	  else
+	    _addGapFill(aFrom * aWidth + aGapStart - 1,1,aWidth,
+			bAlong - aGapStart,aTo - aFrom);
 	}
-    }
-  for(int colId = 0;colId < xSpace + 2;++colId)
-    aDstPt[colId] = (type)aLastLinePt[colId];
+}
 
-  delete [] aFirstLinePt;
-  delete [] aLastLinePt;
-  delete [] anIncBuffer;
+/** @brief weights of one gap, same rules as the 5x1 and 2x2 fills
+ *
+ *  ZERO clears the gap and edges, DISPATCH shares each edge between
+ *  itself and its half of the gap, MEAN goes linearly from one shared
+ *  edge value to the other.
+ */
+void MaxipixReconstruction::_addGapFill(int first,int step,int run_step,
+					int nb_pixel,int nb_run)
+{
+  GapFill aFill;
+  aFill.first = first,aFill.step = step,aFill.run_step = run_step;
+  aFill.nb_pixel = nb_pixel,aFill.nb_run = nb_run;
+  aFill.weights.resize(2 * (nb_pixel + 2),0.f);
 
-  //center lines
-  aDstPt -= (aTotalWidth * (ySpace + 1)) + MAXIPIX_NB_COLUMN - 1;
-  
-  type *aFirstValuePt = aDstPt;
-  type *aSecondValuePt = aDstPt + (aTotalWidth * (ySpace + 1));
-  
-  int aNbChip = 2;
-  do
+  int aNbFirst = (nb_pixel + 3) >> 1;
+  int aNbLast = (nb_pixel + 2) >> 1;
+  int aNbMean = (nb_pixel >> 1) + 1;
+  for(int pixelId = 0;pixelId < nb_pixel + 2;++pixelId)
     {
-      for(int i = MAXIPIX_NB_COLUMN - 1;i;--i,++aFirstValuePt,++aSecondValuePt)
+      float *aWeight = &aFill.weights[2 * pixelId];
+      switch(m_type)
 	{
-	  float aFirstValue = *aFirstValuePt / float(aNbYPixel2Dispatch);
-	  float aLastValue = *aSecondValuePt / float(aNbYPixel2Dispatch);
-	  anInc = (aLastValue - aFirstValue) / (ySpace + 1);
-	  *aFirstValuePt = (type)aFirstValue;
-	  *aSecondValuePt = (type)aLastValue;
+	case DISPATCH:
+	  if(pixelId < aNbFirst)
+	    aWeight[0] = 1.f / aNbFirst;
+	  else
+	    aWeight[1] = 1.f / aNbLast;
+	  break;
+	case MEAN:
+	  {
+	    float aRatio = float(pixelId) / (nb_pixel + 1);
+	    aWeight[0] = (1.f - aRatio) / aNbMean;
+	    aWeight[1] = aRatio / aNbMean;
+	  }
+	  break;
+	default:		// ZERO
+	  break;
+	}
+    }
+  m_gap_fills.push_back(aFill);
+}
 
-	  aFirstValue += anInc;
+/** @brief the runs of a L_GENERAL gap crossing [x0,x1) x [y0,y1)
+ *
+ *  false if none, otherwise [fx0,fx1) x [fy0,fy1) holds them with their
+ *  edges. Runs go across the gap, consecutive runs are next to each other
+ *  on a line (run_step 1) or on a column.
+ */
+template<class GapFill>
+static bool _crossing_runs(const GapFill &aFill,int aWidth,int x0,int y0,int x1,int y1,
+			   int &fx0,int &fy0,int &fx1,int &fy1)
+{
+  int aFirstX = aFill.first % aWidth,aFirstY = aFill.first / aWidth;
+  int aNbAcross = aFill.nb_pixel + 2;
+  if(aFill.run_step == 1)
+    {
+      fy0 = aFirstY,fy1 = aFirstY + aNbAcross;
+      fx0 = std::max(x0,aFirstX),fx1 = std::min(x1,aFirstX + aFill.nb_run);
+    }
+  else
+    {
+      fx0 = aFirstX,fx1 = aFirstX + aNbAcross;
+      fy0 = std::max(y0,aFirstY),fy1 = std::min(y1,aFirstY + aFill.nb_run);
+    }
+  return fx0 < fx1 && fy0 < fy1 && fx0 < x1 && fx1 > x0 && fy0 < y1 && fy1 > y0;
+}
 
-	  for(int lineIter = 0;lineIter < ySpace;++lineIter,aFirstValue += anInc)
-	    aFirstValuePt[(1 + lineIter) * aTotalWidth] = (type)aFirstValue;
+/** @brief [aFirst,aEnd) grown to the whole 2x2 gap after aChipSize pixels
+ *
+ *  with the edges it is filled from, if it touches them.
+ */
+static inline void _grow_to_gap(int &aFirst,int &aEnd,int aChipSize,int aGap)
+{
+  int aGapFirst = aChipSize - 1,aGapEnd = aChipSize + aGap + 1;
+  if(aFirst < aGapEnd && aEnd > aGapFirst)
+    aFirst = std::min(aFirst,aGapFirst),aEnd = std::max(aEnd,aGapEnd);
+}
+
+/** @brief the image part the output roi needs, for the lazy reconstruction
+ *
+ *  m_lazy_roi is the output roi grown to the gaps it touches and to the
+ *  chip edges they are filled from (for L_GENERAL again for the gaps
+ *  sharing these edges), whole lines for 5x1. m_lazy_plan places the chip
+ *  tiles in it and m_lazy_fills are the L_GENERAL gap runs crossing it. No
+ *  lazy roi when the output roi is not set or its part is the whole image.
+ */
+void MaxipixReconstruction::_buildLazyPlan()
+{
+  m_lazy_roi = Roi();
+  m_lazy_plan.clear();
+  m_lazy_fills.clear();
+  if(!m_output_roi.isActive() || m_layout == L_NONE ||
+     ((m_layout == L_FREE || _isGeneralLayout()) && m_remap_plan.empty()))
+    return;
+
+  Size aFullSize = _getFullImageSize();
+  int aWidth = aFullSize.getWidth(),aHeight = aFullSize.getHeight();
+  Point aTopLeft = m_output_roi.getTopLeft();
+  Size aRoiSize = m_output_roi.getSize();
+  int x0 = std::max(aTopLeft.x,0),y0 = std::max(aTopLeft.y,0);
+  int x1 = std::min(aTopLeft.x + aRoiSize.getWidth(),aWidth);
+  int y1 = std::min(aTopLeft.y + aRoiSize.getHeight(),aHeight);
+  if(x0 >= x1 || y0 >= y1)
+    return;
+
+  if(_isLineLayout())
+    x0 = 0,x1 = aWidth;
+  else if(_is2x2Layout())
+    {
+      _grow_to_gap(x0,x1,MAXIPIX_NB_COLUMN,m_xgap);
+      _grow_to_gap(y0,y1,MAXIPIX_NB_LINE,m_ygap);
+    }
+  else if(_isGeneralLayout())
+    {
+      // each gap run only needs its two edges, themselves maybe spread by
+      // the runs of another gap
+      for(bool aGrown = true;aGrown;)
+	{
+	  aGrown = false;
+	  for(GapFills::const_iterator i = m_gap_fills.begin();i != m_gap_fills.end();++i)
+	    {
+	      int fx0,fy0,fx1,fy1;
+	      if(!_crossing_runs(*i,aWidth,x0,y0,x1,y1,fx0,fy0,fx1,fy1) ||
+		 (fx0 >= x0 && fy0 >= y0 && fx1 <= x1 && fy1 <= y1))
+		continue;
+	      aGrown = true;
+	      x0 = std::min(x0,fx0),y0 = std::min(y0,fy0);
+	      x1 = std::max(x1,fx1),y1 = std::max(y1,fy1);
+	    }
+	}
+      for(GapFills::const_iterator i = m_gap_fills.begin();i != m_gap_fills.end();++i)
+	{
+	  int fx0,fy0,fx1,fy1;
+	  if(!_crossing_runs(*i,aWidth,x0,y0,x1,y1,fx0,fy0,fx1,fy1))
+	    continue;
+	  GapFill aFill = *i;
+	  int aFirstRun = i->run_step == 1 ? fx0 - i->first % aWidth :
+	    fy0 - i->first / aWidth;
+	  aFill.first += aFirstRun * i->run_step;
+	  aFill.nb_run = i->run_step == 1 ? fx1 - fx0 : fy1 - fy0;
+	  m_lazy_fills.push_back(aFill);
 	}
-      aFirstValuePt += xSpace + 2;
-      aSecondValuePt += xSpace + 2;
     }
-  while(--aNbChip);
+  if(x0 == 0 && y0 == 0 && x1 == aWidth && y1 == aHeight)
+    {
+      m_lazy_fills.clear();
+      return;
+    }
+  m_lazy_roi = Roi(x0,y0,x1 - x0,y1 - y0);
 
-  aDstPt += MAXIPIX_NB_COLUMN - 1 + aTotalWidth;
-  for(int aLineIter = MAXIPIX_NB_LINE - 1;aLineIter;--aLineIter,aDstPt += aTotalWidth)
+  for(RemapPlan::const_iterator i = m_remap_plan.begin();i != m_remap_plan.end();++i)
     {
-      float aFirstValue = *aDstPt / float(aNbXPixel2Dispatch);
-      float aLastValue = aDstPt[xSpace + 1] / float(aNbXPixel2Dispatch);
-      float anInc = (aLastValue - aFirstValue) / (xSpace + 1);
-      *aDstPt = (type)aFirstValue;
-      aDstPt[xSpace + 1] = (type)aLastValue;
-      aFirstValue += anInc;
+      int aFirstLine,aEndLine,aFirstColumn,aEndColumn;
+      if(!_chip_tiles(i->dst_offset / m_remap_width,y0,y1,aFirstLine,aEndLine) ||
+	 !_chip_tiles(i->dst_offset % m_remap_width,x0,x1,aFirstColumn,aEndColumn))
+	continue;
+      ChipRemap aRemap = *i;
+      aRemap.src_offset += aFirstLine * aRemap.line_step + aFirstColumn * aRemap.pixel_step;
+      aRemap.dst_offset += aFirstLine * m_remap_width + aFirstColumn;
+      aRemap.nb_line = aEndLine - aFirstLine;
+      aRemap.nb_column = aEndColumn - aFirstColumn;
+      m_lazy_plan.push_back(aRemap);
+    }
+}
+
+/** @brief bin the reconstructed image before giving it out
+ *
+ *  pixels are summed in 32 bits (64 bits for 32 bits pixels) and
+ *  saturated to the pixel type. Bin(1,1), the default, disables it.
+ */
+void MaxipixReconstruction::setOutputBin(const Bin& aBin)
+{
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR1(aBin);
+
+  if(aBin.getX() < 1 || aBin.getY() < 1)
+    THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR1(aBin);
+  Size aRoiSize = _getOutputRoi().getSize();
+  if(aRoiSize.getWidth() < aBin.getX() || aRoiSize.getHeight() < aBin.getY())
+    THROW_HW_ERROR(InvalidValue) << DEB_VAR1(aBin) << " bigger than "
+				 << DEB_VAR1(aRoiSize);
+  m_output_bin = aBin;
+  m_buffers->clear();
+}
+
+Bin MaxipixReconstruction::getOutputBin() const
+{
+  return m_output_bin;
+}
 
-      for(int i = 0;i < xSpace;++i,aFirstValue += anInc)
-	aDstPt[1 + i] = (type)aFirstValue;
+/** @brief crop the reconstructed image (before binning)
+ *
+ *  aRoi is in reconstructed image coordinates, an empty roi (default)
+ *  keeps the whole image. To be set once the layout geometry is. Only the
+ *  chip tiles and gaps the roi needs are then reconstructed.
+ */
+void MaxipixReconstruction::setOutputRoi(const Roi& aRoi)
+{
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR1(aRoi);
+
+  if(aRoi.isActive())
+    {
+      Size aFullSize = _getFullImageSize();
+      Point aTopLeft = aRoi.getTopLeft();
+      Size aRoiSize = aRoi.getSize();
+      if(aTopLeft.x < 0 || aTopLeft.y < 0 ||
+	 aTopLeft.x + aRoiSize.getWidth() > aFullSize.getWidth() ||
+	 aTopLeft.y + aRoiSize.getHeight() > aFullSize.getHeight())
+	THROW_HW_ERROR(InvalidValue) << DEB_VAR1(aRoi) << " out of "
+				     << DEB_VAR1(aFullSize);
+      if(aRoiSize.getWidth() < m_output_bin.getX() ||
+	 aRoiSize.getHeight() < m_output_bin.getY())
+	THROW_HW_ERROR(InvalidValue) << DEB_VAR1(aRoi) << " smaller than "
+				     << DEB_VAR1(m_output_bin);
     }
-  
+  m_output_roi = aRoi;
+  _buildLazyPlan();
+  m_buffers->clear();
 }
 
-template<class type>
-static inline void _copy_chip(int i,int nb_chips,Data &aData,char* aBuffer)
+Roi MaxipixReconstruction::getOutputRoi() const
 {
-  int aTotalWidth = nb_chips * MAXIPIX_NB_COLUMN;
-  type *src = (type*)aData.data() + i * MAXIPIX_NB_COLUMN;
-  type *dst = (type*)aBuffer;
+  return m_output_roi;
+}
 
-  for(int lineId = 0;lineId < MAXIPIX_NB_LINE;
-      ++lineId,dst += MAXIPIX_NB_COLUMN,src += aTotalWidth)
-    memcpy(dst,src,sizeof(type)*MAXIPIX_NB_COLUMN);
+bool MaxipixReconstruction::_hasOutputStage() const
+{
+  return !m_output_bin.isOne() || m_output_roi.isActive();
 }
 
-template<class type>
-static inline void _rot_chip_90(int chip_id,int nb_chips,
-				char *aBuffer,Data &dst_data)
+Roi MaxipixReconstruction::_getOutputRoi() const
+{
+  if(m_output_roi.isActive())
+    return m_output_roi;
+  return Roi(Point(0,0),_getFullImageSize());
+}
+
+/** @brief per pixel gain applied to the reconstructed image
+ *
+ *  aFlatField is a FLOAT image of the reconstructed image size (before
+ *  output roi and binning), an empty Data disables the flat field.
+ */
+void MaxipixReconstruction::setFlatField(const Data& aFlatField)
 {
-  int aTotalWidth = (nb_chips - 1) * MAXIPIX_NB_COLUMN;
-  type *src = (type*)aBuffer;
-  type *dst = (type*)dst_data.data();
-  dst += chip_id * MAXIPIX_NB_COLUMN;
-  for(int lineId = 0;lineId < MAXIPIX_NB_LINE;++lineId,dst += aTotalWidth)
+  DEB_MEMBER_FUNCT();
+
+  if(aFlatField.empty())
     {
-      type *src_column = src + ((MAXIPIX_NB_LINE - 1) * MAXIPIX_NB_COLUMN) + lineId;
-      for(int colId = 0;colId < MAXIPIX_NB_COLUMN;++colId,++dst,src_column -= MAXIPIX_NB_COLUMN)
-	*dst = *src_column;
+      m_flat_field.clear();
+      return;
     }
+
+  Size aSize = _getFullImageSize();
+  if(aFlatField.type != Data::FLOAT)
+    THROW_HW_ERROR(InvalidValue) << "Flat field must be a FLOAT image";
+  if(aFlatField.dimensions.size() != 2 ||
+     aFlatField.dimensions[0] != aSize.getWidth() ||
+     aFlatField.dimensions[1] != aSize.getHeight())
+    THROW_HW_ERROR(InvalidValue) << "Flat field size doesn't match image "
+				 << DEB_VAR1(aSize);
+  const float *aGainPt = (const float*)aFlatField.data();
+  m_flat_field.assign(aGainPt,aGainPt + aSize.getWidth() * aSize.getHeight());
 }
 
-template<class type>
-static inline void _rot_chip_180(int chip_id,int nb_chips,
-				 char *aBuffer,Data &dst_data)
+/** @brief dead or hot pixels to clear or interpolate (see setMaskFill)
+ *
+ *  aMask is an 8 bits image of the reconstructed image size, non zero
+ *  pixels are masked (as in MpxPixelArray). An empty Data disables it.
+ */
+void MaxipixReconstruction::setPixelMask(const Data& aMask)
 {
-  int aTotalWidth = (nb_chips - 1) * MAXIPIX_NB_COLUMN;
-  type *src = (type*)aBuffer;
-  type *dst = (type*)dst_data.data();
-  dst += chip_id * MAXIPIX_NB_COLUMN;
+  DEB_MEMBER_FUNCT();
 
-  for(int lineId = 0;lineId < MAXIPIX_NB_LINE;++lineId,dst += aTotalWidth)
+  m_pixel_mask.clear();
+  if(!aMask.empty())
     {
-      type *src_line = src + (MAXIPIX_NB_LINE - lineId) * MAXIPIX_NB_COLUMN - 1;
-      for(int colId = 0;colId < MAXIPIX_NB_COLUMN;++colId,++dst,--src_line)
-	*dst = *src_line;
-    }  
+      Size aSize = _getFullImageSize();
+      if(aMask.depth() != 1)
+	THROW_HW_ERROR(InvalidValue) << "Pixel mask must be an 8 bits image";
+      if(aMask.dimensions.size() != 2 ||
+	 aMask.dimensions[0] != aSize.getWidth() ||
+	 aMask.dimensions[1] != aSize.getHeight())
+	THROW_HW_ERROR(InvalidValue) << "Pixel mask size doesn't match image "
+				     << DEB_VAR1(aSize);
+      const unsigned char *aMaskPt = (const unsigned char*)aMask.data();
+      m_pixel_mask.assign(aMaskPt,aMaskPt + aSize.getWidth() * aSize.getHeight());
+    }
+  _buildMaskedPixels();
 }
 
-template<class type>
-static inline void _rot_chip_270(int chip_id,int nb_chips,
-				 char *aBuffer,Data &dst_data)
+void MaxipixReconstruction::setMaskFill(MaxipixReconstruction::MaskFill aMaskFill)
+{
+  m_mask_fill = aMaskFill;
+  _buildMaskedPixels();
+}
+
+MaxipixReconstruction::MaskFill MaxipixReconstruction::getMaskFill() const
+{
+  return m_mask_fill;
+}
+
+/** @brief pixels counting at least threshold are set to 0
+ *
+ *  checked on each frame before the flat field, 0 (default) disables it.
+ */
+void MaxipixReconstruction::setHotPixelThreshold(int threshold)
 {
-  int aTotalWidth = (nb_chips - 1) * MAXIPIX_NB_COLUMN;
-  type *src = (type*)aBuffer;
-  type *dst = (type*)dst_data.data();
-  dst += chip_id * MAXIPIX_NB_COLUMN;
-  
-  for(int lineId = 0;lineId < MAXIPIX_NB_LINE;++lineId,dst += aTotalWidth)
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR1(threshold);
+
+  if(threshold < 0)
+    THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR1(threshold);
+  m_hot_pixel_threshold = threshold;
+}
+
+int MaxipixReconstruction::getHotPixelThreshold() const
+{
+  return m_hot_pixel_threshold;
+}
+
+/** @brief drop the correction maps the new geometry doesn't fit anymore
+ */
+void MaxipixReconstruction::_checkCorrection()
+{
+  DEB_MEMBER_FUNCT();
+
+  if(m_flat_field.empty() && m_pixel_mask.empty())
+    return;
+
+  Size aSize = _getFullImageSize();
+  size_t aNbPixel = size_t(aSize.getWidth()) * aSize.getHeight();
+  if(!m_flat_field.empty() && m_flat_field.size() != aNbPixel)
+    {
+      DEB_WARNING() << "Image size changed to " << DEB_VAR1(aSize)
+		    << ", flat field removed";
+      m_flat_field.clear();
+    }
+  if(!m_pixel_mask.empty() && m_pixel_mask.size() != aNbPixel)
     {
-      type *src_column = src + (MAXIPIX_NB_COLUMN - 1) - lineId;
-      for(int colId = 0;colId < MAXIPIX_NB_COLUMN;++colId,++dst,src_column += MAXIPIX_NB_COLUMN)
-	*dst = *src_column;
+      DEB_WARNING() << "Image size changed to " << DEB_VAR1(aSize)
+		    << ", pixel mask removed";
+      m_pixel_mask.clear();
     }
+  _buildMaskedPixels();
 }
 
-MaxipixReconstruction::MaxipixReconstruction(MaxipixReconstruction::Layout aLayout,
-					     MaxipixReconstruction::Type aType) :
-  m_type(aType),m_layout(aLayout),m_xgap(4),m_ygap(4)
+/** @brief list the masked pixels and, to interpolate them, their
+ *  unmasked left, right, top and bottom neighbours
+ */
+void MaxipixReconstruction::_buildMaskedPixels()
 {
+  m_masked_pixels.clear();
+  if(m_pixel_mask.empty())
+    return;
+
+  Size aSize = _getFullImageSize();
+  int aWidth = aSize.getWidth(),aHeight = aSize.getHeight();
+  for(int lineId = 0,offset = 0;lineId < aHeight;++lineId)
+    for(int columnId = 0;columnId < aWidth;++columnId,++offset)
+      {
+	if(!m_pixel_mask[offset])
+	  continue;
+
+	MaskedPixel aPixel;
+	aPixel.offset = offset;
+	aPixel.nb_neighbours = 0;
+	if(m_mask_fill == MASK_INTERPOLATE)
+	  {
+	    int aNeighbours[4] = {columnId > 0 ? offset - 1 : -1,
+				  columnId < aWidth - 1 ? offset + 1 : -1,
+				  lineId > 0 ? offset - aWidth : -1,
+				  lineId < aHeight - 1 ? offset + aWidth : -1};
+	    for(int n = 0;n < 4;++n)
+	      if(aNeighbours[n] >= 0 && !m_pixel_mask[aNeighbours[n]])
+		aPixel.neighbours[aPixel.nb_neighbours++] = aNeighbours[n];
+	  }
+	m_masked_pixels.push_back(aPixel);
+      }
 }
 
-MaxipixReconstruction::MaxipixReconstruction(const MaxipixReconstruction &other) :
-  m_type(other.m_type),m_layout(other.m_layout),
-  m_xgap(other.m_xgap),m_ygap(other.m_ygap), m_chips_position(other.m_chips_position)
+bool MaxipixReconstruction::_hasPixelCorrection() const
 {
+  return !m_flat_field.empty() || m_hot_pixel_threshold > 0 ||
+    !m_masked_pixels.empty();
 }
 
-MaxipixReconstruction::~MaxipixReconstruction()
+/** @brief hot pixels, flat field then masked pixels of a reconstructed image
+ *
+ *  the first two only in aRoi. The 5x1 layout does them while
+ *  reconstructing each band, see _Lines5x1Job.
+ */
+void MaxipixReconstruction::_correct(Data &aData,const Roi &aRoi)
 {
+  if(!m_flat_field.empty() || m_hot_pixel_threshold > 0)
+    {
+      _CorrectJob aJob(aData,m_flat_field.empty() ? NULL : &m_flat_field[0],
+		       m_hot_pixel_threshold,aRoi);
+      _runJob(aJob,(aRoi.getSize().getHeight() + MAXIPIX_NB_LINE_PER_BAND - 1) /
+	      MAXIPIX_NB_LINE_PER_BAND);
+    }
+  _fixMaskedPixels(aData);
 }
 
-void MaxipixReconstruction::setType(MaxipixReconstruction::Type aType)
+void MaxipixReconstruction::_fixMaskedPixels(Data &aData)
 {
-  m_type = aType;
+  if(m_masked_pixels.empty())
+    return;
+  if(aData.type == Data::FLOAT)
+    _fix_masked_pixels((float*)aData.data(),m_masked_pixels);
+  else if(aData.depth() == 4)
+    _fix_masked_pixels((int*)aData.data(),m_masked_pixels);
+  else
+    _fix_masked_pixels((unsigned short*)aData.data(),m_masked_pixels);
 }
 
-void MaxipixReconstruction::setXnYGapSpace(int xSpace,int ySpace)
+/** @brief give FLOAT images instead of the raw pixel type
+ *
+ *  raw pixels are converted while the image is reconstructed, DISPATCH
+ *  and MEAN gaps keep their fractional counts (as do binning and
+ *  flat field). Float images are never built in place.
+ */
+void MaxipixReconstruction::setFloatOutput(bool aFlag)
 {
-  m_xgap = xSpace,m_ygap = ySpace;
+  m_float_output = aFlag;
+  m_buffers->clear();
 }
 
+bool MaxipixReconstruction::getFloatOutput() const
+{
+  return m_float_output;
+}
 
-void MaxipixReconstruction::setChipsPosition(const MaxipixReconstruction::PositionList& pList)
+/** @brief latency of the frames processed since the last resetStats()
+ *
+ *  time of each phase, in ns: total, maximum and a histogram whose bin i
+ *  counts the phases that took [2^i,2^(i+1)) ns. A phase is only counted
+ *  when it is done: no ALLOC in place, no CORRECTION without flat field,
+ *  mask or hot pixel threshold... The 5x1 kernels fill the gaps (and
+ *  correct the pixels) while copying, the 5x1 output stage also bins: all
+ *  of it is COPY. enabled is false when built without
+ *  MAXIPIX_RECONSTRUCTION_STATS.
+ */
+void MaxipixReconstruction::getStats(Stats &aStats) const
 {
-  m_chips_position = pList;
+  aStats.enabled = m_stats.enabled;
+  aStats.nb_frames = _stats_read(m_stats.nb_frames);
+  for(int aPhase = 0;aPhase < Stats::NB_PHASES;++aPhase)
+    {
+      aStats.total_ns[aPhase] = _stats_read(m_stats.total_ns[aPhase]);
+      aStats.max_ns[aPhase] = _stats_read(m_stats.max_ns[aPhase]);
+      for(int aBin = 0;aBin < Stats::NB_BINS;++aBin)
+	aStats.histogram[aPhase][aBin] = _stats_read(m_stats.histogram[aPhase][aBin]);
+    }
 }
 
+/** @brief clear the statistics, frames being processed may be half counted
+ */
+void MaxipixReconstruction::resetStats()
+{
+  _stats_clear(m_stats.nb_frames);
+  for(int aPhase = 0;aPhase < Stats::NB_PHASES;++aPhase)
+    {
+      _stats_clear(m_stats.total_ns[aPhase]);
+      _stats_clear(m_stats.max_ns[aPhase]);
+      for(int aBin = 0;aBin < Stats::NB_BINS;++aBin)
+	_stats_clear(m_stats.histogram[aPhase][aBin]);
+    }
+#ifdef MAXIPIX_RECONSTRUCTION_STATS
+  m_stats.enabled = true;
+#else
+  m_stats.enabled = false;
+#endif
+}
+
+/** @brief size of the images given by process()
+ *
+ *  the reconstructed image size, cropped by the output roi and reduced by
+ *  the output binning if any.
+ */
 lima::Size MaxipixReconstruction::getImageSize() const
+{
+  if(!_hasOutputStage())
+    return _getFullImageSize();
+
+  Size aRoiSize = _getOutputRoi().getSize();
+  return Size(aRoiSize.getWidth() / m_output_bin.getX(),
+	      aRoiSize.getHeight() / m_output_bin.getY());
+}
+
+lima::Size MaxipixReconstruction::_getFullImageSize() const
 {  
   DEB_MEMBER_FUNCT();
      
@@ -585,6 +1243,8 @@ lima::Size MaxipixReconstruction::getImageSize() const
       return _getImageSize(2,2,m_xgap, m_ygap);
     case L_5x1:
       return _getImageSize(5,1, m_xgap, m_ygap);
+    case L_GRID:
+      return _getImageSize(m_xchips,m_ychips,m_xgap,m_ygap);
     case L_FREE:
       return _getImageSize(m_chips_position.size(),1, 0, 0);
     case L_GENERAL:
@@ -634,208 +1294,454 @@ lima::Size MaxipixReconstruction::_getImageSize(int x_chip,int y_chip, int x_gap
 
 Data MaxipixReconstruction::process(Data &aData)
 {
+  _checkFrame(aData);
+  return _process(aData,NULL);
+}
+
+/** @brief the frame must hold the raw chips, and the full image when it is
+ *  reconstructed in place
+ *
+ *  the acquisition buffers are sized from the full image size, never from
+ *  the output roi and binning.
+ */
+void MaxipixReconstruction::_checkFrame(const Data &aData) const
+{
+  DEB_MEMBER_FUNCT();
+  int aNbChips = m_layout == L_FREE || m_layout == L_GENERAL ?
+    int(m_chips_position.size()) : m_xchips * m_ychips;
+  int aNbPixel = aNbChips * MAXIPIX_NB_LINE * MAXIPIX_NB_COLUMN;
+  if(_processingInPlaceFlag && !m_float_output)
+    {
+      Size aFullSize = _getFullImageSize();
+      aNbPixel = std::max(aNbPixel,aFullSize.getWidth() * aFullSize.getHeight());
+    }
+  int aMinSize = aNbPixel * aData.depth();
+  if(aData.size() < aMinSize)
+    THROW_HW_ERROR(InvalidValue) << "Frame too small for the raw chips: "
+				 << DEB_VAR2(aData.size(),aMinSize);
+}
+
+/** @brief reconstruction of nbFrames concatenated frames
+ *
+ *  aData describes the first frame of the buffer, the others follow it
+ *  every aData.size() bytes. The images are returned as the planes of a 3
+ *  dimensions Data, in place over the frames when processing in place:
+ *  images smaller than the frames (output roi or binning) are then packed
+ *  at the start of the buffer, over frames already done.
+ *  Frames are done one after the other with the same geometry, kernels
+ *  and worker threads, in a single task of the processing chain.
+ */
+Data MaxipixReconstruction::processFrames(Data &aData,int nbFrames)
+{
+  DEB_MEMBER_FUNCT();
+  DEB_PARAM() << DEB_VAR1(nbFrames);
+
+  if(nbFrames < 1)
+    THROW_HW_ERROR(InvalidValue) << "Invalid " << DEB_VAR1(nbFrames);
+  if(aData.dimensions.size() != 2)
+    THROW_HW_ERROR(InvalidValue) << "Data must describe a single frame";
+  _checkFrame(aData);
+
+  bool inPlace = _processingInPlaceFlag && !m_float_output;
+  Size aSize = getImageSize();
+  int aRawFrameSize = aData.size();
+
   Data aReturnData;
   aReturnData = aData;
+  if(m_float_output)
+    aReturnData.type = Data::FLOAT;
+  aReturnData.dimensions[0] = aSize.getWidth();
+  aReturnData.dimensions[1] = aSize.getHeight();
+  int aFrameSize = aReturnData.size();
+  aReturnData.dimensions.push_back(nbFrames);
+  if(!inPlace)
+    {
+      Buffer *aNewBuffer = m_buffers->get(aReturnData.size());
+      aReturnData.setBuffer(aNewBuffer);
+      aNewBuffer->unref();
+    }
 
-  if(m_layout == L_5x1)
+  char *aRawPt = (char*)aData.data();
+  char *aImagePt = (char*)aReturnData.data();
+  for(int i = 0;i < nbFrames;++i,aRawPt += aRawFrameSize,aImagePt += aFrameSize)
     {
-      aReturnData.dimensions[0] = MAXIPIX_NB_COLUMN * 5 + 4 * m_xgap;
-      if(!_processingInPlaceFlag)
+      Data aFrame = aData;
+      if(aFrame.frameNumber >= 0)
+	aFrame.frameNumber += i;
+      Buffer *aRawBuffer = new Buffer();
+      aRawBuffer->owner = Buffer::MAPPED;
+      aRawBuffer->data = aRawPt;
+      aFrame.setBuffer(aRawBuffer);
+      aRawBuffer->unref();
+
+      Buffer *aDstBuffer = NULL;
+      if(!inPlace)
 	{
-	  Buffer *aNewBuffer = new Buffer(aReturnData.size());
-	  aReturnData.setBuffer(aNewBuffer);
-	  aNewBuffer->unref();
+	  aDstBuffer = new Buffer();
+	  aDstBuffer->owner = Buffer::MAPPED;
+	  aDstBuffer->data = aImagePt;
 	}
-      switch(m_type)
+      Data aImage = _process(aFrame,aDstBuffer);
+      if(aDstBuffer)
+	aDstBuffer->unref();
+      else if(aImage.data() != aImagePt)
+	memmove(aImagePt,aImage.data(),aFrameSize);
+    }
+  return aReturnData;
+}
+
+/** @brief one frame, the image goes to aDstBuffer if given (out of place)
+ */
+Data MaxipixReconstruction::_process(Data &aData,Buffer *aDstBuffer)
+{
+  STATS_START(aStart);
+  Data aReturnData = _hasOutputStage() ? _reduce(aData,aDstBuffer) :
+    _reconstruct(aData,_processingInPlaceFlag && !m_float_output,m_buffers,aDstBuffer);
+  STATS_FRAME(aStart);
+  return aReturnData;
+}
+
+/** @brief reconstruction followed by the output roi and binning
+ *
+ *  5x1 lines are reconstructed (and corrected) by bands in a small buffer
+ *  and binned from there, the full image is never written. Other layouts
+ *  (in place crops wider than the raw lines, masked pixels) are
+ *  reconstructed in a recycled buffer, only in the part the roi needs
+ *  (see _buildLazyPlan()), or in place for the whole image, then reduced
+ *  in a second pass.
+ */
+Data MaxipixReconstruction::_reduce(Data &aData,Buffer *aDstBuffer)
+{
+  Roi aRoi = _getOutputRoi();
+  Point aTopLeft = aRoi.getTopLeft();
+  Size aSize = getImageSize();
+  int aFullWidth = _getFullImageSize().getWidth();
+  int aNbLine = aSize.getHeight() * m_output_bin.getY();
+  bool inPlace = _processingInPlaceFlag && !m_float_output;
+
+  Data aReturnData;
+  aReturnData = aData;
+  if(m_float_output)
+    aReturnData.type = Data::FLOAT;
+  aReturnData.dimensions[0] = aSize.getWidth();
+  aReturnData.dimensions[1] = aSize.getHeight();
+  int depth = aReturnData.depth();
+  STATS_START(aStart);
+  if(!inPlace)
+    {
+      Buffer *aNewBuffer = m_buffers->get(aReturnData.size(),aDstBuffer);
+      aReturnData.setBuffer(aNewBuffer);
+      aNewBuffer->unref();
+      STATS_PHASE(ALLOC,aStart);
+    }
+
+  Kernel5x1 aKernel = m_kernels_5x1[m_float_output][_rawIndex(aData)];
+  if(_isLineLayout() && aKernel && m_masked_pixels.empty() &&
+     (!inPlace ||
+      aSize.getWidth() <= MAXIPIX_NB_COLUMN * m_xchips * m_output_bin.getY()))
+    {
+      int aRawLineSize = MAXIPIX_NB_COLUMN * m_xchips * aData.depth();
+      int aBandHeight = std::max(MAXIPIX_NB_LINE_PER_BAND / m_output_bin.getY(),1) *
+	m_output_bin.getY();
+      Buffer *aBandBuffer = m_scratch->get(aBandHeight * aFullWidth * depth);
+      _clear_runs(aBandBuffer->data,m_kernel_gap_runs,depth,aBandHeight * aFullWidth);
+      char *aSrcPt = ((char*)aData.data()) + aTopLeft.y * aRawLineSize;
+      char *aDstPt = (char*)aReturnData.data();
+      for(int lineId = 0;lineId < aNbLine;lineId += aBandHeight)
 	{
-	case RAW:
-	  _raw_5x1(aData,aReturnData,m_xgap);break;
-	case ZERO: 
-	  _zero_5x1(aData,aReturnData,m_xgap);break;
-	case DISPATCH:
-	  _dispatch_5x1(aData,aReturnData,m_xgap);break;
-	case MEAN:
-	  _mean_5x1(aData,aReturnData,m_xgap);break;
-	default:		// ERROR
-	  break;
+	  int aNbBandLine = std::min(aBandHeight,aNbLine - lineId);
+	  aKernel(aSrcPt,aBandBuffer->data,m_xchips,m_xgap,aNbBandLine);
+	  if(!m_flat_field.empty() || m_hot_pixel_threshold > 0)
+	    _correct_pixels(aReturnData.type,aBandBuffer->data,m_flat_field.empty() ? NULL :
+			    &m_flat_field[(aTopLeft.y + lineId) * aFullWidth],
+			    aNbBandLine * aFullWidth,m_hot_pixel_threshold);
+	  _bin_lines(aReturnData.type,((char*)aBandBuffer->data) + aTopLeft.x * depth,
+		     aFullWidth,aRoi.getSize().getWidth(),aNbBandLine,
+		     m_output_bin,aDstPt);
+	  aSrcPt += aNbBandLine * aRawLineSize;
+	  aDstPt += aNbBandLine / m_output_bin.getY() * aSize.getWidth() * depth;
 	}
+      aBandBuffer->unref();
+      STATS_PHASE(COPY,aStart);
     }
-  else if(m_layout == L_2x2)			// Layout 2x2
+  else
     {
-      aReturnData.dimensions[0] = MAXIPIX_NB_COLUMN * 2 + m_xgap;
-      aReturnData.dimensions[1] = MAXIPIX_NB_LINE * 2 + m_ygap;
+      bool lazy = m_lazy_roi.isActive() && m_masked_pixels.empty();
+      Data aFullData = _reconstruct(aData,inPlace && !lazy,m_scratch,NULL,lazy);
+      STATS_RESET(aStart);
+      _bin_lines(aReturnData.type,((char*)aFullData.data()) +
+		 (aTopLeft.y * aFullWidth + aTopLeft.x) * depth,
+		 aFullWidth,aRoi.getSize().getWidth(),aNbLine,
+		 m_output_bin,aReturnData.data());
+      STATS_PHASE(BINNING,aStart);
+    }
+  return aReturnData;
+}
 
-      Buffer *aNewBuffer = new Buffer(aReturnData.size());
-      switch(m_type)
+/** @brief raw chips converted to float, for the chip remap of float images
+ *
+ *  aData itself when the image keeps the raw pixel type.
+ */
+Data MaxipixReconstruction::_promoteRaw(Data &aData)
+{
+  if(!m_float_output)
+    return aData;
+
+  Data aRawData;
+  aRawData = aData;
+  aRawData.type = Data::FLOAT;
+  int aNbPixel = m_remap_plan.size() * MAXIPIX_NB_LINE * MAXIPIX_NB_COLUMN;
+  Buffer *aRawBuffer = m_scratch->get(aNbPixel * sizeof(float));
+  if(_rawIndex(aData))
+    _promote_pixels((const int*)aData.data(),(float*)aRawBuffer->data,aNbPixel);
+  else
+    _promote_pixels((const unsigned short*)aData.data(),(float*)aRawBuffer->data,aNbPixel);
+  aRawData.setBuffer(aRawBuffer);
+  aRawBuffer->unref();
+  return aRawData;
+}
+
+/** @brief index of the raw pixel type in the kernel tables
+ *
+ *  from the type of the acquired frame: 0 for 16 bit pixels, 1 for 32 bit
+ *  (accumulated) pixels. Float is only the type of the images given out,
+ *  never of the raw frames.
+ */
+int MaxipixReconstruction::_rawIndex(const Data &aData) const
+{
+  DEB_MEMBER_FUNCT();
+  switch(aData.type)
+    {
+    case Data::UINT16:
+    case Data::INT16:
+      return 0;
+    case Data::UINT32:
+    case Data::INT32:
+      return 1;
+    default:
+      THROW_HW_ERROR(NotSupported) << "Raw frame type not supported: "
+				   << DEB_VAR1(aData.type);
+    }
+}
+
+/** @brief reconstruct the full image
+ *
+ *  in aData if inPlace, otherwise in a buffer of aPool. Float images are
+ *  never in place. lazy (out of place, no masked pixel) only reconstructs
+ *  m_lazy_roi and corrects the output roi, the rest of the image is left
+ *  as it was in the buffer.
+ */
+Data MaxipixReconstruction::_reconstruct(Data &aData,bool inPlace,_BufferPool *aPool,
+					 Buffer *aDstBuffer,bool lazy)
+{
+  Data aReturnData;
+  aReturnData = aData;
+  if(m_float_output)
+    aReturnData.type = Data::FLOAT;
+  // the full image, the output roi and binning are done by _reduce()
+  Size aFullSize = _getFullImageSize();
+  aReturnData.dimensions[0] = aFullSize.getWidth();
+  aReturnData.dimensions[1] = aFullSize.getHeight();
+  int aRawIndex = _rawIndex(aData);
+  Roi aRoi = lazy ? m_lazy_roi : Roi(Point(0,0),aFullSize);
+  const RemapPlan &aPlan = lazy ? m_lazy_plan : m_remap_plan;
+  STATS_START(aStart);
+
+  if(_isLineLayout())
+    {
+      if(!inPlace)
 	{
-	case RAW:
-	  if(aReturnData.depth() == 4)
-	    _raw_2x2<int>(aData,aNewBuffer,m_xgap,m_ygap);
-	  else
-	    _raw_2x2<unsigned short>(aData,aNewBuffer,m_xgap,m_ygap);
-	  break;
-	case ZERO:
-	  if(aReturnData.depth() == 4)
-	    _zero_2x2<int>(aData,aNewBuffer,m_xgap,m_ygap);
-	  else
-	    _zero_2x2<unsigned short>(aData,aNewBuffer,m_xgap,m_ygap);
-	  break;
-	case DISPATCH:
-	  if(aReturnData.depth() == 4)
-	    _dispatch_2x2<int>(aData,aNewBuffer,m_xgap,m_ygap);
-	  else
-	    _dispatch_2x2<unsigned short>(aData,aNewBuffer,m_xgap,m_ygap);
-	  break;
-	case MEAN:
-	  if(aReturnData.depth() == 4)
-	    _mean_2x2<int>(aData,aNewBuffer,m_xgap,m_ygap);
+	  Buffer *aNewBuffer = aPool->get(aReturnData.size(),aDstBuffer);
+	  aReturnData.setBuffer(aNewBuffer);
+	  aNewBuffer->unref();
+	  _clear_runs(aNewBuffer->data,m_kernel_gap_runs,aReturnData.depth());
+	  STATS_PHASE(ALLOC,aStart);
+	}
+      Kernel5x1 aKernel = m_kernels_5x1[m_float_output][aRawIndex];
+      int aNbBand = MAXIPIX_NB_LINE / MAXIPIX_NB_LINE_PER_BAND;
+      if(!aKernel)
+	;			// ERROR
+      else if(lazy)
+	{
+	  int aFirstLine = aRoi.getTopLeft().y;
+	  aKernel(((char*)aData.data()) + aFirstLine * MAXIPIX_NB_COLUMN * m_xchips * aData.depth(),
+		  ((char*)aReturnData.data()) + aFirstLine * aFullSize.getWidth() *
+		  aReturnData.depth(),m_xchips,m_xgap,aRoi.getSize().getHeight());
+	}
+      else if(!m_flat_field.empty() || m_hot_pixel_threshold > 0)
+	{
+	  _Lines5x1Job aJob(aKernel,aData,aReturnData,m_xchips,m_xgap,
+			    m_flat_field.empty() ? NULL : &m_flat_field[0],
+			    m_hot_pixel_threshold);
+	  if(m_pool && !inPlace)
+	    _runJob(aJob,aNbBand);
 	  else
-	    _mean_2x2<unsigned short>(aData,aNewBuffer,m_xgap,m_ygap);
-	  break;
-	default:		// ERROR
-	  break;
+	    for(int i = aNbBand - 1;i >= 0;--i)
+	      aJob.run(i);
 	}
-
-      if(_processingInPlaceFlag)
+      else if(m_pool && !inPlace)
 	{
-	  unsigned char *aSrcPt = (unsigned char*)aNewBuffer->data;
-	  unsigned char *aDstPt = (unsigned char*)aData.data();
-	  memcpy(aDstPt,aSrcPt,aReturnData.size());
+	  _Lines5x1Job aJob(aKernel,aData,aReturnData,m_xchips,m_xgap);
+	  _runJob(aJob,aNbBand);
 	}
       else
-	aReturnData.setBuffer(aNewBuffer);
-      aNewBuffer->unref();
+	aKernel(aData.data(),aReturnData.data(),m_xchips,m_xgap,MAXIPIX_NB_LINE);
+      STATS_PHASE(COPY,aStart);
+    }
+  else if(_is2x2Layout())			// Layout 2x2
+    {
+      Kernel2x2 aKernel = m_kernels_2x2[m_float_output][aRawIndex];
+      Fill2x2 aFill = m_fills_2x2[m_float_output][aRawIndex];
+      if(!aKernel)
+	;			// ERROR
+      else if(inPlace && m_xgap <= MAXIPIX_NB_COLUMN * 2)
+	{
+	  int aSavedSize = _nb_saved_line_2x2(m_xgap) * MAXIPIX_NB_COLUMN * 2 *
+	    aReturnData.depth();
+	  Buffer *aSavedBuffer = m_scratch->get(aSavedSize);
+	  STATS_PHASE(ALLOC,aStart);
+	  aKernel(aData,aData.data(),aSavedBuffer->data,m_xgap,m_ygap,aRoi);
+	  aSavedBuffer->unref();
+	  STATS_PHASE(COPY,aStart);
+	  aFill(aData.data(),m_xgap,m_ygap);
+	  STATS_PHASE(GAP_FILL,aStart);
+	}
+      else
+	{
+	  Buffer *aNewBuffer = aPool->get(aReturnData.size(),aDstBuffer);
+	  _clear_runs(aNewBuffer->data,m_kernel_gap_runs,aReturnData.depth());
+	  STATS_PHASE(ALLOC,aStart);
+	  aKernel(aData,aNewBuffer->data,NULL,m_xgap,m_ygap,aRoi);
+	  STATS_PHASE(COPY,aStart);
+	  aFill(aNewBuffer->data,m_xgap,m_ygap);
+	  STATS_PHASE(GAP_FILL,aStart);
+	  if(inPlace)
+	    {
+	      memcpy(aData.data(),aNewBuffer->data,aReturnData.size());
+	      STATS_PHASE(COPY_BACK,aStart);
+	    }
+	  else
+	    aReturnData.setBuffer(aNewBuffer);
+	  aNewBuffer->unref();
+	}
     }
   else if(m_layout == L_FREE)
     {
-      if(_processingInPlaceFlag)
+      if(inPlace)
 	{
-	  char aBuffer[MAXIPIX_NB_LINE * MAXIPIX_NB_COLUMN * 4];
-
-	  PositionList::iterator cPos = m_chips_position.begin();
-	  int nb_chips = m_chips_position.size();
-	  for(int i = 0;cPos != m_chips_position.end();++cPos,++i)
+	  if(aReturnData.depth() == 4)
+	    {
+	      _RemapJob<int> aJob(m_remap_plan,m_remap_width,aData,(int*)aData.data(),true);
+	      _runJob(aJob,m_remap_plan.size());
+	    }
+	  else
 	    {
-	      switch(cPos->rotation)
-		{
-		case Rotation_90:
-		  if(aReturnData.depth() == 4)
-		    {
-		      _copy_chip<int>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_90<int>(i,nb_chips,aBuffer,aData);
-		    }
-		  else
-		    {
-		      _copy_chip<unsigned short>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_90<unsigned short>(i,nb_chips,aBuffer,aData);
-		    }
-		  break;
-		case Rotation_180:
-		  if(aReturnData.depth() == 4)
-		    {
-		      _copy_chip<int>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_180<int>(i,nb_chips,aBuffer,aData);
-		    }
-		  else
-		    {
-		      _copy_chip<unsigned short>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_180<unsigned short>(i,nb_chips,aBuffer,aData);
-		    }
-		  break;
-		case Rotation_270:
-		  if(aReturnData.depth() == 4)
-		    {
-		      _copy_chip<int>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_270<int>(i,nb_chips,aBuffer,aData);
-		    }
-		  else
-		    {
-		      _copy_chip<unsigned short>(i,nb_chips,aData,aBuffer);
-		      _rot_chip_270<unsigned short>(i,nb_chips,aBuffer,aData);
-		    }
-		  break;
-		default:
-		  break; // Nothing to do
-		}
+	      _RemapJob<unsigned short> aJob(m_remap_plan,m_remap_width,aData,
+					     (unsigned short*)aData.data(),true);
+	      _runJob(aJob,m_remap_plan.size());
 	    }
 	}
       else
 	{
-	  //@todo if needed
+	  Buffer *aNewBuffer = aPool->get(aReturnData.size(),aDstBuffer);
+	  STATS_PHASE(ALLOC,aStart);
+	  Data aRawData = _promoteRaw(aData);
+	  if(aReturnData.depth() == 4)
+	    {
+	      _RemapJob<int> aJob(aPlan,m_remap_width,aRawData,
+				  (int*)aNewBuffer->data,false);
+	      _runJob(aJob,aPlan.size());
+	    }
+	  else
+	    {
+	      _RemapJob<unsigned short> aJob(aPlan,m_remap_width,aRawData,
+					     (unsigned short*)aNewBuffer->data,false);
+	      _runJob(aJob,aPlan.size());
+	    }
+	  aReturnData.setBuffer(aNewBuffer);
+	  aNewBuffer->unref();
 	}
+      STATS_PHASE(COPY,aStart);
     }
-  else			// L_GENERAL
+  else			// L_GENERAL, L_GRID of several lines
     {
-      Buffer *aNewBuffer = new Buffer(aReturnData.size());
-      memset(aNewBuffer->data,0,aReturnData.size());
-      int chip_id = 0;
-      int nb_chips = m_chips_position.size();
-      for(PositionList::iterator chip_iter = m_chips_position.begin();
-	  chip_iter != m_chips_position.end();++chip_iter,++chip_id)
+      int depth = aReturnData.depth();
+      Buffer *aImageBuffer = NULL;
+      if(!inPlace)
+	{
+	  aImageBuffer = aPool->get(aReturnData.size(),aDstBuffer);
+	  STATS_PHASE(ALLOC,aStart);
+	}
+      char *aDstPt = (char*)(aImageBuffer ? aImageBuffer->data : aData.data());
+      if(inPlace && !m_line_moves.empty())
 	{
-	  int depth = aReturnData.depth();
-	  int src_line_stride = nb_chips * MAXIPIX_NB_COLUMN * depth;
-	  int dst_line_stride = aReturnData.dimensions[0] * depth;
-	  int o_y = chip_iter->origin.y;
-	  int o_x = chip_iter->origin.x;
-	  unsigned char* dst = ((unsigned char*)aNewBuffer->data) + o_y * dst_line_stride +
-	    o_x * depth;
-
-	  switch(chip_iter->rotation)
+	  // chip lines moved one after the other, see _buildLineMoves()
+	  Buffer *aChipBuffer = m_scratch->get(MAXIPIX_NB_LINE * MAXIPIX_NB_COLUMN * depth);
+	  STATS_PHASE(ALLOC,aStart);
+	  if(depth == 4)
+	    _remapInPlace((int*)aDstPt,(int*)aChipBuffer->data);
+	  else
+	    _remapInPlace((unsigned short*)aDstPt,(unsigned short*)aChipBuffer->data);
+	  aChipBuffer->unref();
+	}
+      else
+	{
+	  Data aRawData = _promoteRaw(aData);
+	  if(inPlace)
+	    {
+	      // chips covering each other: the raw chips are kept aside,
+	      // the image is then built over them
+	      int aRawSize = m_remap_plan.size() * MAXIPIX_NB_LINE * MAXIPIX_NB_COLUMN * depth;
+	      Buffer *aRawBuffer = m_scratch->get(aRawSize);
+	      STATS_PHASE(ALLOC,aStart);
+	      memcpy(aRawBuffer->data,aData.data(),aRawSize);
+	      aRawData.setBuffer(aRawBuffer);
+	      aRawBuffer->unref();
+	      STATS_PHASE(COPY_BACK,aStart);
+	    }
+	  if(depth == 4)
 	    {
-	    case Rotation_270:
-	      for(int col_id = 0;col_id < MAXIPIX_NB_COLUMN;++col_id)
-		{
-		  unsigned char* src = ((unsigned char*)aData.data()) + (chip_id * MAXIPIX_NB_COLUMN * depth + 
-									 (MAXIPIX_NB_COLUMN - 1 - col_id) * depth);
-		  unsigned char* local_dst = dst + dst_line_stride * col_id;
-		  for(int line_id = 0;line_id < MAXIPIX_NB_LINE;++line_id,src += src_line_stride,local_dst += depth)
-		    memcpy(local_dst,src,depth);
-		}
-	      break;
-	    case Rotation_180:
-	      for(int line_id = 0;line_id < MAXIPIX_NB_LINE;++line_id)
-		{
-		  unsigned char* src = ((unsigned char*)aData.data()) + (chip_id * MAXIPIX_NB_COLUMN * depth + 
-									 (MAXIPIX_NB_LINE - 1 - line_id) * src_line_stride +
-									 (MAXIPIX_NB_COLUMN - 1 ) * depth);
-		  unsigned char* local_dst = dst + dst_line_stride * line_id;
-		  for(int col_id = 0;col_id < MAXIPIX_NB_COLUMN;++col_id,local_dst += depth,src -= depth)
-		    memcpy(local_dst,src,depth);
-		}
-	      break;
-	    case Rotation_90:
-	      for(int col_id = 0;col_id < MAXIPIX_NB_COLUMN;++col_id)
-		{
-		  unsigned char* src = ((unsigned char*)aData.data()) + (chip_id * MAXIPIX_NB_COLUMN * depth +
-									 ((MAXIPIX_NB_LINE - 1) * src_line_stride) +
-									 col_id * depth);
-		  unsigned char* local_dst = dst + dst_line_stride * col_id;
-		  for(int line_id = 0;line_id < MAXIPIX_NB_LINE;++line_id,src -= src_line_stride,local_dst += depth)
-		    memcpy(local_dst,src,depth);
-		}
-	      break;
-	    default:
-	      {
-		unsigned char* src = ((unsigned char*)aData.data()) + chip_id * MAXIPIX_NB_COLUMN * depth;
-		for(int line_id = 0;line_id < MAXIPIX_NB_LINE;++line_id,src += src_line_stride,dst += dst_line_stride)
-		  memcpy(dst,src,MAXIPIX_NB_COLUMN * depth);
-	      }
-	      break;
+	      _RemapJob<int> aJob(aPlan,m_remap_width,aRawData,(int*)aDstPt,false);
+	      _runJob(aJob,aPlan.size());
+	    }
+	  else
+	    {
+	      _RemapJob<unsigned short> aJob(aPlan,m_remap_width,aRawData,
+					     (unsigned short*)aDstPt,false);
+	      _runJob(aJob,aPlan.size());
 	    }
 	}
-	  
+      // after the chips, the gaps may hold raw pixels in place
+      _clear_runs(aDstPt,m_gap_runs,depth);
+      STATS_PHASE(COPY,aStart);
+      const GapFills &aFills = lazy ? m_lazy_fills : m_gap_fills;
+      if(aReturnData.type == Data::FLOAT)
+	_fill_gaps((float*)aDstPt,aFills);
+      else if(depth == 4)
+	_fill_gaps((int*)aDstPt,aFills);
+      else
+	_fill_gaps((unsigned short*)aDstPt,aFills);
+      STATS_PHASE(GAP_FILL,aStart);
 
-      if(_processingInPlaceFlag)
+      if(aImageBuffer)
 	{
-	  unsigned char *aSrcPt = (unsigned char*)aNewBuffer->data;
-	  unsigned char *aDstPt = (unsigned char*)aData.data();
-	  memcpy(aDstPt,aSrcPt,aReturnData.size());
+	  aReturnData.setBuffer(aImageBuffer);
+	  aImageBuffer->unref();
 	}
-      else
-	aReturnData.setBuffer(aNewBuffer);
-      aNewBuffer->unref();
     }
 
+  if(_isLineLayout() && !lazy)	// others done by _Lines5x1Job
+    {
+      if(!m_masked_pixels.empty())
+	{
+	  _fixMaskedPixels(aReturnData);
+	  STATS_PHASE(CORRECTION,aStart);
+	}
+    }
+  else if(_hasPixelCorrection())
+    {
+      _correct(aReturnData,lazy ? m_output_roi : aRoi);
+      STATS_PHASE(CORRECTION,aStart);
+    }
   return aReturnData;
 }
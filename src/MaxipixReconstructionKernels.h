@@ -0,0 +1,1403 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2015
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+#ifndef MAXIPIXRECONSTRUCTIONKERNELS_H
+#define MAXIPIXRECONSTRUCTIONKERNELS_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "MaxipixReconstruction.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MAXIPIX_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// pixel kernels of the reconstruction: chip lines, gap fills,
+// remap/transpose, binning and correction.
+// Only included by MaxipixReconstruction.cpp.
+
+namespace lima {
+namespace Maxipix {
+
+static const int MAXIPIX_LINE_SIZE = 256 * 2;
+static const int MAXIPIX_NB_LINE = 256;
+static const int MAXIPIX_NB_COLUMN = 256;
+
+//----------------------------------------------------------------------------
+//			  5x1 line kernel
+//----------------------------------------------------------------------------
+/** @brief 5x1 reconstruction of nbLine lines
+ *
+ *  of nbChip chips side by side (5 for L_5x1, any for a single line
+ *  L_GRID). src and dst point to the first raw and image line. Lines are
+ *  walked backwards, and chips from right to left, so it stays valid in
+ *  place (whole frame in one call). Fill gives the gap pixels,
+ *  Fill::EDGE is 1 when the last pixel of all chips but the last one
+ *  belongs to the gap.
+ */
+template<class type,class Fill>
+static void _lines_5x1(void *src,void *dst,int nbChip,int xSpace,int nbLine)
+{
+  int aSrcWidth = MAXIPIX_NB_COLUMN * nbChip;
+  int aDstWidth = aSrcWidth + (nbChip - 1) * xSpace;
+  int aChipCopySize = (MAXIPIX_NB_COLUMN - Fill::EDGE) * sizeof(type);
+  int aLastChip = nbChip - 1;
+
+  type *aSrcLine = ((type*)src) + aSrcWidth * (nbLine - 1);
+  type *aDstLine = ((type*)dst) + aDstWidth * (nbLine - 1);
+  for(int aNbLine = nbLine;aNbLine;--aNbLine,aSrcLine -= aSrcWidth,aDstLine -= aDstWidth)
+    {
+      memmove(aDstLine + aLastChip * (MAXIPIX_NB_COLUMN + xSpace),
+	      aSrcLine + aLastChip * MAXIPIX_NB_COLUMN,
+	      MAXIPIX_NB_COLUMN * sizeof(type));
+      for(int chipId = aLastChip - 1;chipId >= 0;--chipId)
+	{
+	  Fill::gap5x1(aDstLine + (chipId + 1) * (MAXIPIX_NB_COLUMN + xSpace),
+		       aSrcLine + (chipId + 1) * MAXIPIX_NB_COLUMN,xSpace);
+	  memmove(aDstLine + chipId * (MAXIPIX_NB_COLUMN + xSpace),
+		  aSrcLine + chipId * MAXIPIX_NB_COLUMN,
+		  aChipCopySize);
+	}
+    }
+}
+//----------------------------------------------------------------------------
+//			  5x1 SIMD line kernels
+//----------------------------------------------------------------------------
+// _lines_5x1 copies each chip line with one memmove and rewrites the gap
+// pixels one by one. The kernels below keep the same backward order (so
+// they stay valid in place) but copy chip lines with unaligned vector
+// loads/stores and write each gap zone with a single blend/store, the gap
+// values being computed exactly as the scalar code does.
+// They are only used when the CPU supports them (checked at runtime) and when
+// the gap fits in one vector window.
+static const int MAXIPIX_SIMD_WINDOW = 8;	// pixels written by one gap store
+static const int MAXIPIX_SIMD_MAX_GAP = MAXIPIX_SIMD_WINDOW - 2;
+
+enum SimdLevel {SIMD_NONE, SIMD_SSE41, SIMD_AVX2};
+
+#ifdef MAXIPIX_X86_SIMD
+/** @brief what the CPU supports, capped by the MAXIPIX_SIMD environment
+ *  variable (none, sse4.1 or avx2) to check the kernels against each other
+ */
+static SimdLevel _cpu_simd_level()
+{
+  SimdLevel aLevel =
+    (__builtin_cpu_init(),__builtin_cpu_supports("avx2")) ? SIMD_AVX2 :
+    __builtin_cpu_supports("sse4.1") ? SIMD_SSE41 : SIMD_NONE;
+  const char *aForced = getenv("MAXIPIX_SIMD");
+  if(aForced)
+    {
+      std::string aName = aForced;
+      SimdLevel aMax = aName == "avx2" ? SIMD_AVX2 :
+	aName == "sse4.1" ? SIMD_SSE41 : SIMD_NONE;
+      aLevel = std::min(aLevel,aMax);
+    }
+  return aLevel;
+}
+#endif
+
+static SimdLevel _simd_level()
+{
+#ifdef MAXIPIX_X86_SIMD
+  static const SimdLevel aLevel = _cpu_simd_level();
+  return aLevel;
+#else
+  return SIMD_NONE;
+#endif
+}
+
+/** @brief gap zone of one 5x1 line, relative to the last pixel of the left chip
+ *
+ *  first/nb give the written pixels inside the window, mask has all bits set
+ *  for those lanes. Only the values change from one line to the other.
+ */
+template<class type>
+struct GapZone
+{
+  int first;
+  int nb;
+  type mask[MAXIPIX_SIMD_WINDOW];
+  type value[MAXIPIX_SIMD_WINDOW];
+};
+
+template<class type,class Fill>
+static void _init_gap_zone(GapZone<type> &aZone,int xSpace)
+{
+  Fill::zone5x1(xSpace,aZone.first,aZone.nb);
+  for(int i = 0;i < MAXIPIX_SIMD_WINDOW;++i)
+    {
+      bool inZone = i >= aZone.first && i < aZone.first + aZone.nb;
+      aZone.mask[i] = inZone ? type(-1) : type(0);
+      aZone.value[i] = 0;
+    }
+}
+
+#ifdef MAXIPIX_X86_SIMD
+/** @brief SSE4.1 primitives
+ *
+ *  copy() is a backward copy (valid in place as long as aDst >= aSrc):
+ *  the first and last vectors are loaded before any store.
+ */
+struct Sse41
+{
+  typedef __m128i Vector;
+  enum {VECTOR_SIZE = sizeof(Vector)};
+
+  __attribute__((target("sse4.1")))
+  static void copy(void *aDst,const void *aSrc,int nbBytes)
+  {
+    const char *aSrcPt = (const char*)aSrc;
+    char *aDstPt = (char*)aDst;
+    Vector aHead = _mm_loadu_si128((const Vector*)aSrcPt);
+    Vector aTail = _mm_loadu_si128((const Vector*)(aSrcPt + nbBytes - VECTOR_SIZE));
+    _mm_storeu_si128((Vector*)(aDstPt + nbBytes - VECTOR_SIZE),aTail);
+    for(int i = nbBytes - 2 * VECTOR_SIZE;i > 0;i -= VECTOR_SIZE)
+      _mm_storeu_si128((Vector*)(aDstPt + i),_mm_loadu_si128((const Vector*)(aSrcPt + i)));
+    _mm_storeu_si128((Vector*)aDstPt,aHead);
+  }
+
+  template<class type>
+  __attribute__((target("sse4.1")))
+  static void storeGap(type *aDst,const GapZone<type> &aZone)
+  {
+    for(int i = 0;i < int(MAXIPIX_SIMD_WINDOW * sizeof(type));i += VECTOR_SIZE)
+      {
+	Vector *aDstPt = (Vector*)((char*)aDst + i);
+	Vector aMask = _mm_loadu_si128((const Vector*)((const char*)aZone.mask + i));
+	Vector aValue = _mm_loadu_si128((const Vector*)((const char*)aZone.value + i));
+	_mm_storeu_si128(aDstPt,_mm_blendv_epi8(_mm_loadu_si128(aDstPt),aValue,aMask));
+      }
+  }
+};
+
+/** @brief AVX2 primitives, same contract as Sse41
+ */
+struct Avx2
+{
+  typedef __m256i Vector;
+  enum {VECTOR_SIZE = sizeof(Vector)};
+
+  __attribute__((target("avx2")))
+  static void copy(void *aDst,const void *aSrc,int nbBytes)
+  {
+    const char *aSrcPt = (const char*)aSrc;
+    char *aDstPt = (char*)aDst;
+    Vector aHead = _mm256_loadu_si256((const Vector*)aSrcPt);
+    Vector aTail = _mm256_loadu_si256((const Vector*)(aSrcPt + nbBytes - VECTOR_SIZE));
+    _mm256_storeu_si256((Vector*)(aDstPt + nbBytes - VECTOR_SIZE),aTail);
+    for(int i = nbBytes - 2 * VECTOR_SIZE;i > 0;i -= VECTOR_SIZE)
+      _mm256_storeu_si256((Vector*)(aDstPt + i),_mm256_loadu_si256((const Vector*)(aSrcPt + i)));
+    _mm256_storeu_si256((Vector*)aDstPt,aHead);
+  }
+
+  template<class type>
+  __attribute__((target("avx2")))
+  static void storeGap(type *aDst,const GapZone<type> &aZone)
+  {
+    if(sizeof(type) == 2)
+      {
+	__m128i *aDstPt = (__m128i*)aDst;
+	__m128i aMask = _mm_loadu_si128((const __m128i*)aZone.mask);
+	__m128i aValue = _mm_loadu_si128((const __m128i*)aZone.value);
+	_mm_storeu_si128(aDstPt,_mm_blendv_epi8(_mm_loadu_si128(aDstPt),aValue,aMask));
+      }
+    else
+      {
+	Vector *aDstPt = (Vector*)aDst;
+	Vector aMask = _mm256_loadu_si256((const Vector*)aZone.mask);
+	Vector aValue = _mm256_loadu_si256((const Vector*)aZone.value);
+	_mm256_storeu_si256(aDstPt,_mm256_blendv_epi8(_mm256_loadu_si256(aDstPt),aValue,aMask));
+      }
+  }
+};
+
+/** @brief 5x1 reconstruction with vector primitives
+ *
+ *  For each line (last one first) the chips are copied from right to
+ *  left. The edge pixels of the gap on the left of a chip are read from
+ *  the source before it is copied (the chip copy only writes over raw
+ *  pixels already read) and its gap zone is blended in once both chips
+ *  are in place. Same pixels as _lines_5x1<type,Fill>.
+ */
+template<class type,class Fill,class Isa>
+static void _simd_lines_5x1(void *src,void *dst,int nbChip,int xSpace,int nbLine)
+{
+  int aSrcWidth = MAXIPIX_NB_COLUMN * nbChip;
+  int aDstWidth = aSrcWidth + (nbChip - 1) * xSpace;
+  int aChipCopySize = (MAXIPIX_NB_COLUMN - Fill::EDGE) * sizeof(type);
+  int aLastChip = nbChip - 1;
+
+  GapZone<type> aZone;
+  _init_gap_zone<type,Fill>(aZone,xSpace);
+
+  type *aSrcLine = ((type*)src) + aSrcWidth * (nbLine - 1);
+  type *aDstLine = ((type*)dst) + aDstWidth * (nbLine - 1);
+  for(int aNbLine = nbLine;aNbLine;--aNbLine,aSrcLine -= aSrcWidth,aDstLine -= aDstWidth)
+    {
+      Isa::copy(aDstLine + aLastChip * (MAXIPIX_NB_COLUMN + xSpace),
+		aSrcLine + aLastChip * MAXIPIX_NB_COLUMN,
+		MAXIPIX_NB_COLUMN * sizeof(type));
+      for(int gapId = aLastChip - 1;gapId >= 0;--gapId)
+	{
+	  type aLeftPixel = aSrcLine[(gapId + 1) * MAXIPIX_NB_COLUMN - 1];
+	  type aRightPixel = aSrcLine[(gapId + 1) * MAXIPIX_NB_COLUMN];
+	  Isa::copy(aDstLine + gapId * (MAXIPIX_NB_COLUMN + xSpace),
+		    aSrcLine + gapId * MAXIPIX_NB_COLUMN,
+		    aChipCopySize);
+	  Fill::values5x1(aZone.value + aZone.first,xSpace,aLeftPixel,aRightPixel);
+	  Isa::storeGap(aDstLine + (gapId + 1) * MAXIPIX_NB_COLUMN + gapId * xSpace - 1,aZone);
+	}
+    }
+}
+#endif
+//----------------------------------------------------------------------------
+//			     2x2 function
+//----------------------------------------------------------------------------
+template<class type>
+static inline void _raw_2x2(type *dst,int xSpace,int ySpace)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  type *aDstPt = dst + MAXIPIX_NB_COLUMN;
+  for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth)
+    for(int k = 0;k < xSpace;++k)
+      aDstPt[k] = 0;
+  
+  aDstPt -= MAXIPIX_NB_COLUMN;
+  int aGapSize = aTotalWidth * ySpace;
+  memset(aDstPt,0,aGapSize * sizeof(type));
+  aDstPt += aGapSize;
+
+  aDstPt += MAXIPIX_NB_COLUMN;
+  for(int i = MAXIPIX_NB_LINE;i;--i,aDstPt += aTotalWidth)
+    for(int k = 0;k < xSpace;++k)
+      aDstPt[k] = 0;
+}
+
+template<class type>
+static inline void _zero_2x2(type *dst,int xSpace,int ySpace)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  type *aDstPt = dst + MAXIPIX_NB_COLUMN - 1;
+  for(int i = MAXIPIX_NB_LINE - 1;i;--i,aDstPt += aTotalWidth)
+    for(int k = 0;k < xSpace + 2;++k)
+      aDstPt[k] = 0;
+  
+  aDstPt -= MAXIPIX_NB_COLUMN - 1;
+  int aGapSize = aTotalWidth * (ySpace + 2);
+  memset(aDstPt,0,aGapSize * sizeof(type));
+  aDstPt += aGapSize;
+
+  aDstPt += MAXIPIX_NB_COLUMN - 1;
+  for(int i = MAXIPIX_NB_LINE - 1;i;--i,aDstPt += aTotalWidth)
+    for(int k = 0;k < xSpace + 2;++k)
+      aDstPt[k] = 0;
+}
+
+template<class type>
+static inline void _dispatch_2x2(type *dst,int xSpace,int ySpace)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  type *aDstPt = dst + MAXIPIX_NB_COLUMN - 1;
+  int aNbPixel2Dispatch = (xSpace >> 1) + 1;
+
+  for(int lineId = MAXIPIX_NB_LINE - 1;lineId;--lineId)
+    {
+      type aPixelValue = *aDstPt / aNbPixel2Dispatch;
+      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
+	*aDstPt = aPixelValue;
+
+      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / aNbPixel2Dispatch;
+      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
+	*aDstPt = aPixelValue;
+  
+      aDstPt += aTotalWidth - (xSpace + 2);
+    }
+  
+
+  aDstPt -= MAXIPIX_NB_COLUMN - 1;
+  int aNbPixel2DispatchInY = (ySpace >> 1) + 1;
+  
+  int aPart = 2;
+  /* aPart == 2 => upper chip
+     aPart == 1 => bottom chip
+  */
+  do
+    {
+      type aPixelValue;
+      //Last line or first line of left chip (depend on aPart)
+      for(int columnIter = MAXIPIX_NB_COLUMN - 1;columnIter;--columnIter,++aDstPt)
+	{
+	  aPixelValue = *aDstPt / aNbPixel2DispatchInY;
+	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
+	    aDstPt[aTotalWidth * y] = aPixelValue;
+	}
+  
+      //Bottom or top right corner of left chip
+      aPixelValue = *aDstPt / (aNbPixel2DispatchInY * aNbPixel2Dispatch);
+      for(int columnIter = aNbPixel2Dispatch;columnIter;--columnIter,++aDstPt)
+	{
+	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
+	    aDstPt[aTotalWidth * y] = aPixelValue;
+	}
+      //Bottom or top left corner of right chip
+      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / (aNbPixel2DispatchInY * aNbPixel2Dispatch);
+      for(int columnIter = aNbPixel2Dispatch;columnIter;--columnIter,++aDstPt)
+	{
+	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
+	    aDstPt[aTotalWidth * y] = aPixelValue;
+	}
+      //Last or first line of right chip
+      for(int columnIter = MAXIPIX_NB_COLUMN - 1;columnIter;--columnIter,++aDstPt)
+	{
+	  aPixelValue = *aDstPt / aNbPixel2DispatchInY;
+	  for(int y = 0;y < aNbPixel2DispatchInY;++y)
+	    aDstPt[aTotalWidth * y] = aPixelValue;
+	}
+      
+      //Set Variable for second part iteration (bottom chip)
+      aDstPt += aTotalWidth * ySpace;
+      aTotalWidth = -aTotalWidth;
+    }
+  while(--aPart);
+
+  aDstPt = dst + aTotalWidth * (MAXIPIX_NB_LINE + ySpace + 1) +
+    MAXIPIX_NB_COLUMN - 1;
+  
+  for(int lineId = MAXIPIX_NB_LINE - 1;lineId;--lineId)
+    {
+      type aPixelValue = *aDstPt / aNbPixel2Dispatch;
+      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
+	*aDstPt = aPixelValue;
+
+      aPixelValue = aDstPt[aNbPixel2Dispatch - 1] / aNbPixel2Dispatch;
+      for(int i = aNbPixel2Dispatch;i;--i,++aDstPt)
+	*aDstPt = aPixelValue;
+  
+      aDstPt += aTotalWidth - (xSpace + 2);
+    }
+}
+
+template<class type>
+static inline void _mean_2x2(type *dst,int xSpace,int ySpace)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  type *aDstPt = dst + MAXIPIX_NB_COLUMN - 1;
+  int aNbXPixel2Dispatch = (xSpace >> 1) + 1;
+  int aNbYPixel2Dispatch = (ySpace >> 1) + 1;
+
+  for(int aLineIter = MAXIPIX_NB_LINE - 1;aLineIter;--aLineIter,aDstPt += aTotalWidth)
+    {
+      float aFirstValue = *aDstPt / float(aNbXPixel2Dispatch);
+      float aLastValue = aDstPt[xSpace + 1] / float(aNbXPixel2Dispatch);
+      float anInc = (aLastValue - aFirstValue) / (xSpace + 1);
+      *aDstPt = (type)aFirstValue;
+      aDstPt[xSpace + 1] = (type)aLastValue;
+      aFirstValue += anInc;
+
+      for(int i = 0;i < xSpace;++i,aFirstValue += anInc)
+	aDstPt[1 + i] = (type)aFirstValue;
+    }
+
+  //corner
+  int aNbPixel2Dispatch = aNbXPixel2Dispatch + aNbYPixel2Dispatch;
+  float a1ftCornerValue = *aDstPt / float(aNbPixel2Dispatch);
+  float a2ndCornerValue = aDstPt[xSpace + 1] / float(aNbPixel2Dispatch);
+  float a3thCornerValue = aDstPt[(ySpace + 1) * aTotalWidth]  / float(aNbPixel2Dispatch);
+  float a4thCornerValue = aDstPt[(ySpace + 1) * aTotalWidth + xSpace + 1] / float(aNbPixel2Dispatch);
+  
+  float *aFirstLinePt = new float[xSpace +2];
+  aFirstLinePt[0] = a1ftCornerValue;
+  aFirstLinePt[xSpace + 1] = a2ndCornerValue;
+  float anInc = (a2ndCornerValue - a1ftCornerValue) / (xSpace + 1);
+  for(int i = 0;i < xSpace;++i)
+    aFirstLinePt[i + 1] = aFirstLinePt[i] + anInc;
+
+  float *aLastLinePt = new float[xSpace + 2];
+  aLastLinePt[0] = a3thCornerValue;
+  aLastLinePt[xSpace + 1] = a4thCornerValue;
+  anInc = (a4thCornerValue - a3thCornerValue) / (xSpace + 1);
+  for(int i = 0;i < xSpace;++i)
+    aLastLinePt[i + 1] = aLastLinePt[i] + anInc;
+  
+  float *anIncBuffer = new float[xSpace + 2];
+  for(int i = 0;i < xSpace + 2;++i)
+    anIncBuffer[i] = (aLastLinePt[i] - aFirstLinePt[i]) / (ySpace + 1);
+  
+  
+  for(int lineIter = ySpace + 1;lineIter;--lineIter,aDstPt += aTotalWidth)
+    {
+      for(int colId = 0;colId < xSpace + 2;++colId)
+	{
+	  aDstPt[colId] = (type)aFirstLinePt[colId];
+	  aFirstLinePt[colId] += anIncBuffer[colId];
+	}
+    }
+  for(int colId = 0;colId < xSpace + 2;++colId)
+    aDstPt[colId] = (type)aLastLinePt[colId];
+
+  delete [] aFirstLinePt;
+  delete [] aLastLinePt;
+  delete [] anIncBuffer;
+
+  //center lines
+  aDstPt -= (aTotalWidth * (ySpace + 1)) + MAXIPIX_NB_COLUMN - 1;
+  
+  type *aFirstValuePt = aDstPt;
+  type *aSecondValuePt = aDstPt + (aTotalWidth * (ySpace + 1));
+  
+  int aNbChip = 2;
+  do
+    {
+      for(int i = MAXIPIX_NB_COLUMN - 1;i;--i,++aFirstValuePt,++aSecondValuePt)
+	{
+	  float aFirstValue = *aFirstValuePt / float(aNbYPixel2Dispatch);
+	  float aLastValue = *aSecondValuePt / float(aNbYPixel2Dispatch);
+	  anInc = (aLastValue - aFirstValue) / (ySpace + 1);
+	  *aFirstValuePt = (type)aFirstValue;
+	  *aSecondValuePt = (type)aLastValue;
+
+	  aFirstValue += anInc;
+
+	  for(int lineIter = 0;lineIter < ySpace;++lineIter,aFirstValue += anInc)
+	    aFirstValuePt[(1 + lineIter) * aTotalWidth] = (type)aFirstValue;
+	}
+      aFirstValuePt += xSpace + 2;
+      aSecondValuePt += xSpace + 2;
+    }
+  while(--aNbChip);
+
+  aDstPt += MAXIPIX_NB_COLUMN - 1 + aTotalWidth;
+  for(int aLineIter = MAXIPIX_NB_LINE - 1;aLineIter;--aLineIter,aDstPt += aTotalWidth)
+    {
+      float aFirstValue = *aDstPt / float(aNbXPixel2Dispatch);
+      float aLastValue = aDstPt[xSpace + 1] / float(aNbXPixel2Dispatch);
+      float anInc = (aLastValue - aFirstValue) / (xSpace + 1);
+      *aDstPt = (type)aFirstValue;
+      aDstPt[xSpace + 1] = (type)aLastValue;
+      aFirstValue += anInc;
+
+      for(int i = 0;i < xSpace;++i,aFirstValue += anInc)
+	aDstPt[1 + i] = (type)aFirstValue;
+    }
+  
+}
+
+//----------------------------------------------------------------------------
+//			     fill types
+//----------------------------------------------------------------------------
+// One structure per MaxipixReconstruction::Type, the layout kernels are
+// templated on it:
+//  - EDGE is 1 when the chip edge pixels belong to the gap
+//  - gap5x1() writes one 5x1 gap, aDstPt/aSrcPt being the first pixel of
+//    the right chip (destination/source)
+//  - zone5x1()/values5x1() describe the same gap for the SIMD kernels
+//  - frame2x2() fills the gaps of a 2x2 image
+template<class type>
+struct RawFill
+{
+  enum {EDGE = 0};
+  static inline void gap5x1(type *aDstPt,const type*,int xSpace)
+  {
+    for(int i = 1;i <= xSpace;++i)
+      aDstPt[-i] = 0;
+  }
+  static void zone5x1(int xSpace,int &first,int &nb) {first = 1,nb = xSpace;}
+  static inline void values5x1(type*,int,type,type) {}
+  static void frame2x2(type *dst,int xSpace,int ySpace) {_raw_2x2(dst,xSpace,ySpace);}
+};
+
+template<class type>
+struct ZeroFill
+{
+  enum {EDGE = 1};
+  static inline void gap5x1(type *aDstPt,const type*,int xSpace)
+  {
+    for(int i = 0;i < xSpace + 2;++i)
+      aDstPt[-i] = 0;
+  }
+  static void zone5x1(int xSpace,int &first,int &nb) {first = 0,nb = xSpace + 2;}
+  static inline void values5x1(type*,int,type,type) {}
+  static void frame2x2(type *dst,int xSpace,int ySpace) {_zero_2x2(dst,xSpace,ySpace);}
+};
+
+template<class type>
+struct DispatchFill
+{
+  enum {EDGE = 1};
+  static inline void gap5x1(type *aDstPt,const type *aSrcPt,int xSpace)
+  {
+    int nbPixelDispatch = (xSpace >> 1) + 1; // (xSpace / 2) + 1
+    type *aPixel = aDstPt;
+    type aPixelValue = *aPixel / nbPixelDispatch;
+    for(int i = nbPixelDispatch;i;--i,--aPixel)
+      *aPixel = aPixelValue;
+
+    aPixelValue = aSrcPt[-1] / nbPixelDispatch;
+    for(int i = nbPixelDispatch;i;--i,--aPixel)
+      *aPixel = aPixelValue;
+  }
+  static void zone5x1(int xSpace,int &first,int &nb)
+  {
+    int nbPixelDispatch = (xSpace >> 1) + 1;
+    first = xSpace + 2 - 2 * nbPixelDispatch,nb = 2 * nbPixelDispatch;
+  }
+  static inline void values5x1(type *aValue,int xSpace,type aLeftPixel,type aRightPixel)
+  {
+    int nbPixelDispatch = (xSpace >> 1) + 1;
+    type aLeftValue = aLeftPixel / nbPixelDispatch;
+    type aRightValue = aRightPixel / nbPixelDispatch;
+    for(int i = 0;i < nbPixelDispatch;++i)
+      aValue[i] = aLeftValue,aValue[nbPixelDispatch + i] = aRightValue;
+  }
+  static void frame2x2(type *dst,int xSpace,int ySpace) {_dispatch_2x2(dst,xSpace,ySpace);}
+};
+
+template<class type>
+struct MeanFill
+{
+  enum {EDGE = 1};
+  static inline void gap5x1(type *aDstPt,const type *aSrcPt,int xSpace)
+  {
+    int nbPixelMean = (xSpace >> 1) + 1; // (xSpace / 2) + 1
+    type *aPixel = aDstPt;
+    type aFirstPixelValue = *aPixel / nbPixelMean;
+    *aPixel = aFirstPixelValue;--aPixel;
+
+    type aSecondPixelValue = aSrcPt[-1] / nbPixelMean;
+    float aStepValue = (aSecondPixelValue - aFirstPixelValue) / (xSpace + 1);
+    float aPixelValue = aFirstPixelValue + aStepValue;
+    for(int i = xSpace + 1;i;--i,aPixelValue += aStepValue,--aPixel)
+      *aPixel = (type)aPixelValue;
+  }
+  static void zone5x1(int xSpace,int &first,int &nb) {first = 0,nb = xSpace + 2;}
+  static inline void values5x1(type *aValue,int xSpace,type aLeftPixel,type aRightPixel)
+  {
+    int nbPixelMean = (xSpace >> 1) + 1;
+    type aFirstPixelValue = aRightPixel / nbPixelMean;
+    type aSecondPixelValue = aLeftPixel / nbPixelMean;
+    float aStepValue = (aSecondPixelValue - aFirstPixelValue) / (xSpace + 1);
+    float aPixelValue = aFirstPixelValue + aStepValue;
+    aValue[xSpace + 1] = aFirstPixelValue;
+    for(int i = xSpace;i >= 0;--i,aPixelValue += aStepValue)
+      aValue[i] = (type)aPixelValue;
+  }
+  static void frame2x2(type *dst,int xSpace,int ySpace) {_mean_2x2(dst,xSpace,ySpace);}
+};
+
+//----------------------------------------------------------------------------
+//			  chip remap functions
+//----------------------------------------------------------------------------
+/** @brief first pixel and steps to walk a chip in destination order
+ *
+ *  stride is the line size (in pixel) of the buffer holding the chip,
+ *  first is relative to the chip first pixel. size is the chip side, a
+ *  tile side can be given instead to rotate a single tile.
+ */
+static void _remap_steps(lima::RotationMode rotation,int stride,
+			 int &first,int &line_step,int &pixel_step,
+			 int size = MAXIPIX_NB_LINE)
+{
+  int last_line = (size - 1) * stride;
+  int last_column = size - 1;
+  switch(rotation)
+    {
+    case lima::Rotation_90:
+      first = last_line,line_step = 1,pixel_step = -stride;break;
+    case lima::Rotation_180:
+      first = last_line + last_column,line_step = -stride,pixel_step = -1;break;
+    case lima::Rotation_270:
+      first = last_column,line_step = -1,pixel_step = stride;break;
+    default:
+      first = 0,line_step = stride,pixel_step = 1;break;
+    }
+}
+
+static const int MAXIPIX_TILE_SIZE = 32;
+
+/** @brief transpose one square block of a rotated chip
+ *
+ *  src is the chip pixel going to dst, line_step is +/-1 and pixel_step
+ *  +/-stride (90 and 270 degree rotation). The generic version moves one
+ *  pixel, the SSE2 ones move 8x8 (16 bits) or 4x4 (32 bits) pixels with an
+ *  in-register transpose: each source column of the block is one vector.
+ */
+template<class type>
+struct TransposeBlock
+{
+  enum {SIZE = 1};
+  static inline void run(const type *src,int,int,type *dst,int)
+  {
+    *dst = *src;
+  }
+};
+
+#if defined(MAXIPIX_X86_SIMD) && defined(__SSE2__)
+template<>
+struct TransposeBlock<unsigned short>
+{
+  enum {SIZE = 8};
+  static inline void run(const unsigned short *src,int line_step,int pixel_step,
+			 unsigned short *dst,int dst_stride)
+  {
+    const unsigned short *aLoadPt = line_step > 0 ? src : src - (SIZE - 1);
+    __m128i r[SIZE];
+    for(int i = 0;i < SIZE;++i,aLoadPt += pixel_step)
+      r[i] = _mm_loadu_si128((const __m128i*)aLoadPt);
+
+    __m128i t0 = _mm_unpacklo_epi16(r[0],r[1]),t1 = _mm_unpackhi_epi16(r[0],r[1]);
+    __m128i t2 = _mm_unpacklo_epi16(r[2],r[3]),t3 = _mm_unpackhi_epi16(r[2],r[3]);
+    __m128i t4 = _mm_unpacklo_epi16(r[4],r[5]),t5 = _mm_unpackhi_epi16(r[4],r[5]);
+    __m128i t6 = _mm_unpacklo_epi16(r[6],r[7]),t7 = _mm_unpackhi_epi16(r[6],r[7]);
+
+    __m128i u0 = _mm_unpacklo_epi32(t0,t2),u1 = _mm_unpackhi_epi32(t0,t2);
+    __m128i u2 = _mm_unpacklo_epi32(t1,t3),u3 = _mm_unpackhi_epi32(t1,t3);
+    __m128i u4 = _mm_unpacklo_epi32(t4,t6),u5 = _mm_unpackhi_epi32(t4,t6);
+    __m128i u6 = _mm_unpacklo_epi32(t5,t7),u7 = _mm_unpackhi_epi32(t5,t7);
+
+    r[0] = _mm_unpacklo_epi64(u0,u4),r[1] = _mm_unpackhi_epi64(u0,u4);
+    r[2] = _mm_unpacklo_epi64(u1,u5),r[3] = _mm_unpackhi_epi64(u1,u5);
+    r[4] = _mm_unpacklo_epi64(u2,u6),r[5] = _mm_unpackhi_epi64(u2,u6);
+    r[6] = _mm_unpacklo_epi64(u3,u7),r[7] = _mm_unpackhi_epi64(u3,u7);
+
+    for(int i = 0;i < SIZE;++i)
+      _mm_storeu_si128((__m128i*)(dst + (line_step > 0 ? i : SIZE - 1 - i) * dst_stride),r[i]);
+  }
+};
+
+template<>
+struct TransposeBlock<int>
+{
+  enum {SIZE = 4};
+  static inline void run(const int *src,int line_step,int pixel_step,
+			 int *dst,int dst_stride)
+  {
+    const int *aLoadPt = line_step > 0 ? src : src - (SIZE - 1);
+    __m128i r[SIZE];
+    for(int i = 0;i < SIZE;++i,aLoadPt += pixel_step)
+      r[i] = _mm_loadu_si128((const __m128i*)aLoadPt);
+
+    __m128i t0 = _mm_unpacklo_epi32(r[0],r[1]),t1 = _mm_unpacklo_epi32(r[2],r[3]);
+    __m128i t2 = _mm_unpackhi_epi32(r[0],r[1]),t3 = _mm_unpackhi_epi32(r[2],r[3]);
+
+    r[0] = _mm_unpacklo_epi64(t0,t1),r[1] = _mm_unpackhi_epi64(t0,t1);
+    r[2] = _mm_unpacklo_epi64(t2,t3),r[3] = _mm_unpackhi_epi64(t2,t3);
+
+    for(int i = 0;i < SIZE;++i)
+      _mm_storeu_si128((__m128i*)(dst + (line_step > 0 ? i : SIZE - 1 - i) * dst_stride),r[i]);
+  }
+};
+#endif
+
+/** @brief 90 or 270 degree rotation of one MAXIPIX_TILE_SIZE square tile
+ */
+template<class type>
+static inline void _transpose_tile(const type *src,int line_step,int pixel_step,
+				   type *dst,int dst_stride)
+{
+  typedef TransposeBlock<type> Block;
+  for(int lineId = 0;lineId < MAXIPIX_TILE_SIZE;lineId += Block::SIZE)
+    {
+      const type *src_block = src + lineId * line_step;
+      type *dst_block = dst + lineId * dst_stride;
+      for(int colId = 0;colId < MAXIPIX_TILE_SIZE;colId += Block::SIZE,
+	    src_block += Block::SIZE * pixel_step,dst_block += Block::SIZE)
+	Block::run(src_block,line_step,pixel_step,dst_block,dst_stride);
+    }
+}
+
+/** @brief 90 or 270 degree chip rotation, walked by MAXIPIX_TILE_SIZE tiles
+ *
+ *  a tile reads MAXIPIX_TILE_SIZE source lines and writes as many
+ *  destination lines, so both stay in L1 instead of striding over the
+ *  whole chip for each destination line. nbLine and nbColumn are whole
+ *  tiles.
+ */
+template<class type>
+static inline void _transpose_chip(const type *src,int line_step,int pixel_step,
+				   type *dst,int dst_stride,int nbLine,int nbColumn)
+{
+  for(int tileLine = 0;tileLine < nbLine;tileLine += MAXIPIX_TILE_SIZE)
+    for(int tileCol = 0;tileCol < nbColumn;tileCol += MAXIPIX_TILE_SIZE)
+      _transpose_tile(src + tileLine * line_step + tileCol * pixel_step,
+		      line_step,pixel_step,
+		      dst + tileLine * dst_stride + tileCol,dst_stride);
+}
+
+/** @brief copy one chip (or nbLine x nbColumn pixels of it) following its remap
+ *
+ *  unrotated chips are copied line by line (contiguous runs), 180 degree
+ *  ones are read backward line by line and the others are transposed.
+ */
+template<class type>
+static inline void _remap_chip(const type *src,int line_step,int pixel_step,
+			       type *dst,int dst_stride,
+			       int nbLine = MAXIPIX_NB_LINE,int nbColumn = MAXIPIX_NB_COLUMN)
+{
+  if(pixel_step == 1)
+    {
+      for(int lineId = 0;lineId < nbLine;
+	  ++lineId,src += line_step,dst += dst_stride)
+	memcpy(dst,src,sizeof(type) * nbColumn);
+    }
+  else if(pixel_step == -1)
+    {
+      for(int lineId = 0;lineId < nbLine;
+	  ++lineId,src += line_step,dst += dst_stride)
+	for(int colId = 0;colId < nbColumn;++colId)
+	  dst[colId] = src[-colId];
+    }
+  else
+    _transpose_chip(src,line_step,pixel_step,dst,dst_stride,nbLine,nbColumn);
+}
+
+/** @brief chip lines (or columns, chips are square) in [first,end) image ones
+ *
+ *  chip is the image line of the chip first line, aFirst and aEnd are
+ *  rounded to whole tiles. false if the chip has none.
+ */
+static inline bool _chip_tiles(int chip,int first,int end,int &aFirst,int &aEnd)
+{
+  aFirst = std::max(first - chip,0) / MAXIPIX_TILE_SIZE * MAXIPIX_TILE_SIZE;
+  aEnd = std::min(end - chip,MAXIPIX_NB_LINE);
+  if(aFirst >= aEnd)
+    return false;
+  aEnd = (aEnd + MAXIPIX_TILE_SIZE - 1) / MAXIPIX_TILE_SIZE * MAXIPIX_TILE_SIZE;
+  return true;
+}
+
+/** @brief L_GENERAL gap fill of one chip pair, see GapFill
+ *
+ *  gap pixels first, the edges are only changed once read. Vertical gaps
+ *  have contiguous runs (run_step == 1) and are filled line by line, a
+ *  loop the compiler vectorizes.
+ */
+template<class type,class GapFill>
+static void _fill_gap(type *dst,const GapFill &aFill)
+{
+  type *aFirstPt = dst + aFill.first;
+  type *aLastPt = aFirstPt + (aFill.nb_pixel + 1) * aFill.step;
+  const float *aWeight = &aFill.weights[0];
+  int aRunStep = aFill.run_step;
+  for(int pixelId = 1;pixelId <= aFill.nb_pixel;++pixelId)
+    {
+      type *aPt = aFirstPt + pixelId * aFill.step;
+      float aFirstWeight = aWeight[2 * pixelId];
+      float aLastWeight = aWeight[2 * pixelId + 1];
+      if(aRunStep == 1)
+	for(int runId = 0;runId < aFill.nb_run;++runId)
+	  aPt[runId] = type(aFirstWeight * aFirstPt[runId] + aLastWeight * aLastPt[runId]);
+      else
+	for(int runId = 0;runId < aFill.nb_run;++runId)
+	  aPt[runId * aRunStep] = type(aFirstWeight * aFirstPt[runId * aRunStep] +
+				       aLastWeight * aLastPt[runId * aRunStep]);
+    }
+
+  const float *aLastWeight = aWeight + 2 * (aFill.nb_pixel + 1);
+  for(int runId = 0;runId < aFill.nb_run;++runId)
+    {
+      type &aFirst = aFirstPt[runId * aRunStep];
+      type &aLast = aLastPt[runId * aRunStep];
+      type aNewFirst = type(aWeight[0] * aFirst + aWeight[1] * aLast);
+      aLast = type(aLastWeight[0] * aFirst + aLastWeight[1] * aLast);
+      aFirst = aNewFirst;
+    }
+}
+
+template<class type,class GapFills>
+static void _fill_gaps(type *dst,const GapFills &aFills)
+{
+  for(typename GapFills::const_iterator i = aFills.begin();i != aFills.end();++i)
+    _fill_gap(dst,*i);
+}
+
+/** @brief clear the (offset,length) pixel runs ending within nbPixel
+ */
+static void _clear_runs(void *dst,const std::vector<std::pair<int,int> > &aRuns,
+			int depth,int nbPixel = -1)
+{
+  char *aDstPt = (char*)dst;
+  for(std::vector<std::pair<int,int> >::const_iterator i = aRuns.begin();
+      i != aRuns.end();++i)
+    if(nbPixel < 0 || i->first + i->second <= nbPixel)
+      memset(aDstPt + i->first * depth,0,i->second * depth);
+}
+
+//----------------------------------------------------------------------------
+//			  in place functions
+//----------------------------------------------------------------------------
+/** @brief rotation of a chip in its own place
+ *
+ *  180 degree swaps pixels pairwise. For 90 and 270 degree tiles are
+ *  moved by cycles of 4 (one per chip quadrant), the first tile of each
+ *  cycle is kept aside on the stack.
+ */
+template<class type>
+static void _rotate_chip_in_place(type *chip,int stride,lima::RotationMode rotation)
+{
+  if(rotation == lima::Rotation_0)
+    return;
+  if(rotation == lima::Rotation_180)
+    {
+      for(int lineId = 0;lineId < MAXIPIX_NB_LINE / 2;++lineId)
+	{
+	  type *aTopPt = chip + lineId * stride;
+	  type *aBottomPt = chip + (MAXIPIX_NB_LINE - 1 - lineId) * stride +
+	    MAXIPIX_NB_COLUMN - 1;
+	  for(int colId = 0;colId < MAXIPIX_NB_COLUMN;++colId)
+	    std::swap(aTopPt[colId],aBottomPt[-colId]);
+	}
+      return;
+    }
+
+  const int nbTile = MAXIPIX_NB_LINE / MAXIPIX_TILE_SIZE;
+  type aTile[MAXIPIX_TILE_SIZE * MAXIPIX_TILE_SIZE];
+  int first,line_step,pixel_step;
+  _remap_steps(rotation,stride,first,line_step,pixel_step);
+  int tile_first,tile_line_step,tile_pixel_step;
+  _remap_steps(rotation,MAXIPIX_TILE_SIZE,tile_first,tile_line_step,tile_pixel_step,
+	       MAXIPIX_TILE_SIZE);
+
+  for(int i = 0;i < nbTile / 2;++i)
+    for(int j = 0;j < nbTile / 2;++j)
+      {
+	// cycle[k + 1] is the tile going to cycle[k]
+	int tileLine[4],tileCol[4];
+	tileLine[0] = i,tileCol[0] = j;
+	for(int k = 1;k < 4;++k)
+	  {
+	    if(rotation == lima::Rotation_90)
+	      tileLine[k] = nbTile - 1 - tileCol[k - 1],tileCol[k] = tileLine[k - 1];
+	    else
+	      tileLine[k] = tileCol[k - 1],tileCol[k] = nbTile - 1 - tileLine[k - 1];
+	  }
+
+	type *aTilePt = chip + (i * stride + j) * MAXIPIX_TILE_SIZE;
+	for(int lineId = 0;lineId < MAXIPIX_TILE_SIZE;++lineId)
+	  memcpy(aTile + lineId * MAXIPIX_TILE_SIZE,aTilePt + lineId * stride,
+		 sizeof(type) * MAXIPIX_TILE_SIZE);
+
+	for(int k = 0;k < 3;++k)
+	  _transpose_tile<type>(chip + first + MAXIPIX_TILE_SIZE *
+				(tileLine[k] * line_step + tileCol[k] * pixel_step),
+				line_step,pixel_step,
+				chip + MAXIPIX_TILE_SIZE * (tileLine[k] * stride + tileCol[k]),
+				stride);
+	_transpose_tile<type>(aTile + tile_first,tile_line_step,tile_pixel_step,
+			      chip + MAXIPIX_TILE_SIZE * (tileLine[3] * stride + tileCol[3]),
+			      stride);
+      }
+}
+
+/** @brief number of raw lines whose bottom chips are kept aside
+ *
+ *  the top chips lines are moved first, to the image beginning, and
+ *  overwrite the bottom chips of the first raw lines.
+ */
+static inline int _nb_saved_line_2x2(int xSpace)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  int aRawWidth = MAXIPIX_NB_COLUMN * 4;
+  int aNbLine = (MAXIPIX_NB_LINE * aTotalWidth + aRawWidth - 1) / aRawWidth;
+  return std::min(aNbLine,int(MAXIPIX_NB_LINE));
+}
+
+/** @brief one band of MAXIPIX_TILE_SIZE lines of a rotated chip
+ *
+ *  the band lines are MAXIPIX_NB_COLUMN pixels, only the tiles from column
+ *  first to end are done, as _transpose_chip() does. The generic version
+ *  also converts the pixels.
+ */
+template<class src_type,class type>
+static inline void _transpose_band(const src_type *src,int line_step,int pixel_step,
+				   type *dst,int first,int end)
+{
+  for(int tileCol = first;tileCol < end;tileCol += MAXIPIX_TILE_SIZE)
+    for(int lineId = 0;lineId < MAXIPIX_TILE_SIZE;++lineId)
+      {
+	const src_type *aSrcPt = src + lineId * line_step + tileCol * pixel_step;
+	type *aDstPt = dst + lineId * MAXIPIX_NB_COLUMN + tileCol;
+	for(int colId = 0;colId < MAXIPIX_TILE_SIZE;++colId,aSrcPt += pixel_step)
+	  aDstPt[colId] = type(*aSrcPt);
+      }
+}
+
+template<class type>
+static inline void _transpose_band(const type *src,int line_step,int pixel_step,
+				   type *dst,int first,int end)
+{
+  for(int tileCol = first;tileCol < end;tileCol += MAXIPIX_TILE_SIZE)
+    _transpose_tile(src + tileCol * pixel_step,line_step,pixel_step,
+		    dst + tileCol,MAXIPIX_NB_COLUMN);
+}
+
+// images from this size are written with non-temporal stores, they would
+// only evict the cache
+static const int MAXIPIX_STREAM_MIN_SIZE = 1024 * 1024;
+
+/** @brief copy of one line, with non-temporal stores if stream
+ */
+static inline void _copy_line(void *dst,const void *src,int size,bool stream)
+{
+#if defined(MAXIPIX_X86_SIMD) && defined(__SSE2__)
+  if(stream)
+    {
+      char *aDstPt = (char*)dst;
+      const char *aSrcPt = (const char*)src;
+      int aHeadSize = std::min(int(-(long)aDstPt & 15),size);
+      memcpy(aDstPt,aSrcPt,aHeadSize);
+      aDstPt += aHeadSize,aSrcPt += aHeadSize,size -= aHeadSize;
+      for(;size >= 16;size -= 16,aDstPt += 16,aSrcPt += 16)
+	_mm_stream_si128((__m128i*)aDstPt,_mm_loadu_si128((const __m128i*)aSrcPt));
+      memcpy(aDstPt,aSrcPt,size);
+      return;
+    }
+#endif
+  memcpy(dst,src,size);
+}
+
+/** @brief 2x2 chip placement, gaps are left to the fill
+ *
+ *  raw line: bottom left | top left | top right | bottom right, the left
+ *  chips are turned by 270 degree and the right ones by 90. Each chip band
+ *  of MAXIPIX_TILE_SIZE lines is transposed in a stack buffer, then its
+ *  lines go to the image one after the other: the image is written line
+ *  by line and not column by column. Only the chip tiles in aRoi are
+ *  placed.
+ */
+template<class src_type,class type>
+static inline void copy_2x2(Data &src,type *dst,int xSpace,int ySpace,const Roi &aRoi)
+{
+  static const int chipLine[4] = {1,0,0,1};	// raw chip to image chip
+  static const int chipColumn[4] = {0,0,1,1};
+
+  int aRawWidth = MAXIPIX_NB_COLUMN * 4;
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  Point aTopLeft = aRoi.getTopLeft();
+  Size aRoiSize = aRoi.getSize();
+  bool stream = aRoiSize.getWidth() * aRoiSize.getHeight() * int(sizeof(type)) >=
+    MAXIPIX_STREAM_MIN_SIZE;
+  const src_type *aSrcPt = (const src_type*)src.data();
+  type aBand[MAXIPIX_TILE_SIZE * MAXIPIX_NB_COLUMN];
+
+  for(int chipId = 0;chipId < 4;++chipId)
+    {
+      int aChipLine = chipLine[chipId] * (MAXIPIX_NB_LINE + ySpace);
+      int aChipColumn = chipColumn[chipId] * (MAXIPIX_NB_COLUMN + xSpace);
+      int aFirstLine,aEndLine,aFirstColumn,aEndColumn;
+      if(!_chip_tiles(aChipLine,aTopLeft.y,aTopLeft.y + aRoiSize.getHeight(),
+		      aFirstLine,aEndLine) ||
+	 !_chip_tiles(aChipColumn,aTopLeft.x,aTopLeft.x + aRoiSize.getWidth(),
+		      aFirstColumn,aEndColumn))
+	continue;
+
+      int first,line_step,pixel_step;
+      _remap_steps(chipId < 2 ? lima::Rotation_270 : lima::Rotation_90,aRawWidth,
+		   first,line_step,pixel_step);
+      const src_type *aChipPt = aSrcPt + chipId * MAXIPIX_NB_COLUMN + first;
+      type *aDstPt = dst + (aChipLine + aFirstLine) * aTotalWidth + aChipColumn + aFirstColumn;
+      int aLineSize = sizeof(type) * (aEndColumn - aFirstColumn);
+      for(int bandLine = aFirstLine;bandLine < aEndLine;bandLine += MAXIPIX_TILE_SIZE)
+	{
+	  _transpose_band(aChipPt + bandLine * line_step,line_step,pixel_step,aBand,
+			  aFirstColumn,aEndColumn);
+	  for(int lineId = 0;lineId < MAXIPIX_TILE_SIZE;++lineId,aDstPt += aTotalWidth)
+	    _copy_line(aDstPt,aBand + lineId * MAXIPIX_NB_COLUMN + aFirstColumn,
+		       aLineSize,stream);
+	}
+    }
+#if defined(MAXIPIX_X86_SIMD) && defined(__SSE2__)
+  if(stream)
+    _mm_sfence();
+#endif
+}
+
+/** @brief same placement as copy_2x2 but in the acquisition buffer
+ *
+ *  each chip is first rotated in its own place, then every line is moved
+ *  to the image: top chips forward, bottom chips backward. aSaved holds
+ *  the bottom chips of the first _nb_saved_line_2x2() raw lines
+ *  (MAXIPIX_NB_COLUMN * 2 pixels per line). Needs xSpace <= 2 chips.
+ */
+template<class type>
+static void _in_place_2x2(type *data,int xSpace,int ySpace,type *aSaved)
+{
+  int aTotalWidth = (MAXIPIX_NB_COLUMN * 2) + xSpace;
+  int aRawWidth = MAXIPIX_NB_COLUMN * 4;
+  int aLineSize = sizeof(type) * MAXIPIX_NB_COLUMN;
+
+  for(int chipId = 0;chipId < 4;++chipId)
+    _rotate_chip_in_place<type>(data + chipId * MAXIPIX_NB_COLUMN,aRawWidth,
+				chipId < 2 ? lima::Rotation_270 : lima::Rotation_90);
+
+  // raw line: bottom left | top left | top right | bottom right
+  int aNbSavedLine = _nb_saved_line_2x2(xSpace);
+  type *aSrcPt = data;
+  type *aSavedPt = aSaved;
+  for(int lineId = 0;lineId < aNbSavedLine;
+      ++lineId,aSrcPt += aRawWidth,aSavedPt += MAXIPIX_NB_COLUMN * 2)
+    {
+      memcpy(aSavedPt,aSrcPt,aLineSize);
+      memcpy(aSavedPt + MAXIPIX_NB_COLUMN,aSrcPt + MAXIPIX_NB_COLUMN * 3,aLineSize);
+    }
+
+  aSrcPt = data;
+  type *aDstPt = data;
+  for(int lineId = 0;lineId < MAXIPIX_NB_LINE;
+      ++lineId,aSrcPt += aRawWidth,aDstPt += aTotalWidth)
+    {
+      memmove(aDstPt,aSrcPt + MAXIPIX_NB_COLUMN,aLineSize);
+      memmove(aDstPt + MAXIPIX_NB_COLUMN + xSpace,aSrcPt + MAXIPIX_NB_COLUMN * 2,aLineSize);
+    }
+
+  aDstPt = data + (MAXIPIX_NB_LINE * 2 + ySpace - 1) * aTotalWidth;
+  for(int lineId = MAXIPIX_NB_LINE - 1;lineId >= 0;--lineId,aDstPt -= aTotalWidth)
+    {
+      const type *aLeftPt,*aRightPt;
+      if(lineId < aNbSavedLine)
+	aLeftPt = aSaved + lineId * MAXIPIX_NB_COLUMN * 2,
+	  aRightPt = aLeftPt + MAXIPIX_NB_COLUMN;
+      else
+	aLeftPt = data + lineId * aRawWidth,
+	  aRightPt = aLeftPt + MAXIPIX_NB_COLUMN * 3;
+      memmove(aDstPt + MAXIPIX_NB_COLUMN + xSpace,aRightPt,aLineSize);
+      memmove(aDstPt,aLeftPt,aLineSize);
+    }
+  // the gaps still hold raw pixels, clear them as in a new buffer
+  _raw_2x2(data,xSpace,ySpace);
+}
+
+//----------------------------------------------------------------------------
+//			  layout kernels
+//----------------------------------------------------------------------------
+/** @brief 2x2 chip placement, from src to dst or in place when aSaved is
+ *  given, the gaps are filled after by _fill_2x2
+ *
+ *  src_type is the raw pixel type, type the image one (only the same
+ *  types can be used in place). In place the whole image is placed,
+ *  whatever aRoi.
+ */
+template<class src_type,class type>
+static void _kernel_2x2(Data &src,void *dst,void *aSaved,int xSpace,int ySpace,
+			const Roi &aRoi)
+{
+  if(aSaved)
+    _in_place_2x2<type>((type*)dst,xSpace,ySpace,(type*)aSaved);
+  else
+    copy_2x2<src_type,type>(src,(type*)dst,xSpace,ySpace,aRoi);
+}
+
+template<class type,class Fill>
+static void _fill_2x2(void *dst,int xSpace,int ySpace)
+{
+  Fill::frame2x2((type*)dst,xSpace,ySpace);
+}
+
+template<class src_type>
+static inline void _promote_pixels(const src_type *src,float *dst,int nbPixel)
+{
+  for(int i = 0;i < nbPixel;++i)
+    dst[i] = src[i];
+}
+
+/** @brief 5x1 reconstruction to a float image
+ *
+ *  each raw line is converted in a line buffer, then reconstructed from
+ *  there with the float kernel: gap values keep their fractional part.
+ *  Never in place.
+ */
+template<class src_type,class Fill>
+static void _float_lines_5x1(void *src,void *dst,int nbChip,int xSpace,int nbLine)
+{
+  int aSrcWidth = MAXIPIX_NB_COLUMN * nbChip;
+  int aDstWidth = aSrcWidth + (nbChip - 1) * xSpace;
+  std::vector<float> aLine(aSrcWidth);
+  const src_type *aSrcLine = (const src_type*)src;
+  float *aDstLine = (float*)dst;
+  for(int lineId = 0;lineId < nbLine;++lineId,aSrcLine += aSrcWidth,aDstLine += aDstWidth)
+    {
+      _promote_pixels(aSrcLine,&aLine[0],aSrcWidth);
+      _lines_5x1<float,Fill>(&aLine[0],aDstLine,nbChip,xSpace,1);
+    }
+}
+
+/** @brief 5x1 kernel for a gap size: vector one if the gap fits its
+ *  window and the CPU supports it, scalar one otherwise
+ */
+template<class type,class Fill,class Kernel>
+static void _select_5x1(int xSpace,Kernel &aKernel)
+{
+  aKernel = _lines_5x1<type,Fill>;
+#ifdef MAXIPIX_X86_SIMD
+  if(xSpace < 0 || xSpace > MAXIPIX_SIMD_MAX_GAP)
+    return;
+  switch(_simd_level())
+    {
+    case SIMD_AVX2:
+      aKernel = _simd_lines_5x1<type,Fill,Avx2>;break;
+    case SIMD_SSE41:
+      aKernel = _simd_lines_5x1<type,Fill,Sse41>;break;
+    default:
+      break;
+    }
+#endif
+}
+
+//----------------------------------------------------------------------------
+//			  output roi and binning
+//----------------------------------------------------------------------------
+/** @brief sum type of the output binning, and saturation to the pixel type
+ */
+template<class type>
+struct BinSum;
+
+template<>
+struct BinSum<unsigned short>
+{
+  typedef unsigned int Type;
+  static unsigned short saturate(Type aSum) {return aSum > 0xffff ? 0xffff : aSum;}
+  static unsigned short mean(Type aSum,int nb) {return (aSum + nb / 2) / nb;}
+};
+
+template<>
+struct BinSum<int>
+{
+  typedef long long Type;
+  static int saturate(Type aSum)
+  {
+    return aSum > INT_MAX ? INT_MAX : aSum < INT_MIN ? INT_MIN : int(aSum);
+  }
+  static int mean(Type aSum,int nb) {return int((aSum + nb / 2) / nb);}
+};
+
+template<>
+struct BinSum<float>
+{
+  typedef double Type;
+  static float saturate(Type aSum) {return float(aSum);}
+  static float mean(Type aSum,int nb) {return float(aSum / nb);}
+};
+
+static const int MAXIPIX_BIN_CHUNK = 512;	// source pixels summed at once
+
+/** @brief bin nbLine lines of width pixels into dst
+ *
+ *  src lines are src_width pixels apart, dst gets nbLine / bin_y lines of
+ *  width / bin_x pixels. The bin_y lines of an output line are first
+ *  summed column by column, then bin_x columns at a time.
+ *  BIN_X is the horizontal binning if known at compile time, 0 otherwise.
+ *  Valid in place as long as dst <= src.
+ */
+template<class type,int BIN_X>
+static void _bin_lines(const type *src,int src_width,int width,int nbLine,
+		       int bin_x,int bin_y,type *dst)
+{
+  typedef typename BinSum<type>::Type Sum;
+  if(BIN_X)
+    bin_x = BIN_X;
+  int aDstWidth = width / bin_x;
+  int aChunk = MAXIPIX_BIN_CHUNK / bin_x * bin_x;
+  for(int lineId = nbLine / bin_y;lineId;
+      --lineId,src += src_width * bin_y,dst += aDstWidth)
+    {
+      if(bin_x == 1 && bin_y == 1)
+	{
+	  memmove(dst,src,aDstWidth * sizeof(type));
+	  continue;
+	}
+      type *aDstPt = dst;
+      for(int colId = 0;colId < aDstWidth * bin_x;colId += aChunk)
+	{
+	  int aNbPixel = std::min(aChunk,aDstWidth * bin_x - colId);
+	  Sum aSum[MAXIPIX_BIN_CHUNK];
+	  const type *aLinePt = src + colId;
+	  for(int i = 0;i < aNbPixel;++i)
+	    aSum[i] = aLinePt[i];
+	  for(int y = 1;y < bin_y;++y)
+	    {
+	      aLinePt += src_width;
+	      for(int i = 0;i < aNbPixel;++i)
+		aSum[i] += aLinePt[i];
+	    }
+	  for(int i = 0;i < aNbPixel;i += bin_x,++aDstPt)
+	    {
+	      Sum aPixel = aSum[i];
+	      for(int x = 1;x < bin_x;++x)
+		aPixel += aSum[i + x];
+	      *aDstPt = BinSum<type>::saturate(aPixel);
+	    }
+	}
+    }
+}
+
+template<class type>
+static void _bin_lines(const type *src,int src_width,int width,int nbLine,
+		       int bin_x,int bin_y,type *dst)
+{
+  switch(bin_x)
+    {
+    case 2:
+      _bin_lines<type,2>(src,src_width,width,nbLine,bin_x,bin_y,dst);break;
+    case 4:
+      _bin_lines<type,4>(src,src_width,width,nbLine,bin_x,bin_y,dst);break;
+    default:
+      _bin_lines<type,0>(src,src_width,width,nbLine,bin_x,bin_y,dst);break;
+    }
+}
+
+static void _bin_lines(Data::TYPE aType,const void *src,int src_width,int width,
+		       int nbLine,const Bin &aBin,void *dst)
+{
+  if(aType == Data::FLOAT)
+    _bin_lines<float>((const float*)src,src_width,width,nbLine,
+		      aBin.getX(),aBin.getY(),(float*)dst);
+  else if(aType == Data::INT32 || aType == Data::UINT32)
+    _bin_lines<int>((const int*)src,src_width,width,nbLine,
+		    aBin.getX(),aBin.getY(),(int*)dst);
+  else
+    _bin_lines<unsigned short>((const unsigned short*)src,src_width,width,nbLine,
+			       aBin.getX(),aBin.getY(),(unsigned short*)dst);
+}
+
+//----------------------------------------------------------------------------
+//			  pixel correction
+//----------------------------------------------------------------------------
+/** @brief flat field computation type and rounding to the pixel type
+ */
+template<class type>
+struct FlatField;
+
+template<>
+struct FlatField<unsigned short>
+{
+  typedef float Type;
+  static unsigned short round(Type aValue)
+  {
+    aValue = std::min(std::max(aValue + .5f,0.f),65535.f);
+    return (unsigned short)(int)aValue;
+  }
+};
+
+template<>
+struct FlatField<float>
+{
+  typedef float Type;
+  static float round(Type aValue) {return aValue;}
+};
+
+template<>
+struct FlatField<int>
+{
+  typedef double Type;
+  static int round(Type aValue)
+  {
+    aValue = std::min(std::max(aValue,double(INT_MIN)),double(INT_MAX));
+    return int(aValue >= 0. ? aValue + .5 : aValue - .5);
+  }
+};
+
+/** @brief hot pixel clearing and flat field of nbPixel contiguous pixels
+ *
+ *  pixels >= hotThreshold (if > 0) are set to 0, then multiplied by aGain
+ *  (if not NULL). Plain loops left to the compiler vectorizer, built a
+ *  second time for AVX2 (the 16 <-> 32 bits conversions are much cheaper).
+ */
+template<class type>
+static inline void _correct_pixels(type *aPt,const float *aGain,int nbPixel,int hotThreshold)
+{
+  typedef typename FlatField<type>::Type Float;
+  if(hotThreshold > 0)
+    for(int i = 0;i < nbPixel;++i)
+      aPt[i] = aPt[i] >= hotThreshold ? 0 : aPt[i];
+  if(aGain)
+    for(int i = 0;i < nbPixel;++i)
+      aPt[i] = FlatField<type>::round(Float(aPt[i]) * aGain[i]);
+}
+
+template<class type>
+static void _correct_pixels_default(type *aPt,const float *aGain,int nbPixel,
+				    int hotThreshold)
+{
+  _correct_pixels(aPt,aGain,nbPixel,hotThreshold);
+}
+
+#ifdef MAXIPIX_X86_SIMD
+template<class type>
+__attribute__((target("avx2")))
+static void _correct_pixels_avx2(type *aPt,const float *aGain,int nbPixel,
+				 int hotThreshold)
+{
+  _correct_pixels(aPt,aGain,nbPixel,hotThreshold);
+}
+#endif
+
+static void _correct_pixels(Data::TYPE aType,void *aPt,const float *aGain,int nbPixel,
+			    int hotThreshold)
+{
+#ifdef MAXIPIX_X86_SIMD
+  if(_simd_level() == SIMD_AVX2)
+    {
+      if(aType == Data::FLOAT)
+	_correct_pixels_avx2<float>((float*)aPt,aGain,nbPixel,hotThreshold);
+      else if(aType == Data::INT32 || aType == Data::UINT32)
+	_correct_pixels_avx2<int>((int*)aPt,aGain,nbPixel,hotThreshold);
+      else
+	_correct_pixels_avx2<unsigned short>((unsigned short*)aPt,aGain,nbPixel,
+					     hotThreshold);
+      return;
+    }
+#endif
+  if(aType == Data::FLOAT)
+    _correct_pixels_default<float>((float*)aPt,aGain,nbPixel,hotThreshold);
+  else if(aType == Data::INT32 || aType == Data::UINT32)
+    _correct_pixels_default<int>((int*)aPt,aGain,nbPixel,hotThreshold);
+  else
+    _correct_pixels_default<unsigned short>((unsigned short*)aPt,aGain,nbPixel,
+					    hotThreshold);
+}
+
+/** @brief masked pixels set to 0 or to the mean of their unmasked neighbours
+ *
+ *  done once the whole image is corrected, neighbours are never masked.
+ */
+template<class type,class MaskedPixels>
+static void _fix_masked_pixels(type *aPt,const MaskedPixels &aMaskedPixels)
+{
+  typedef typename BinSum<type>::Type Sum;
+  for(typename MaskedPixels::const_iterator i = aMaskedPixels.begin();
+      i != aMaskedPixels.end();++i)
+    {
+      Sum aSum = 0;
+      for(int n = 0;n < i->nb_neighbours;++n)
+	aSum += aPt[i->neighbours[n]];
+      aPt[i->offset] = i->nb_neighbours ?
+	BinSum<type>::mean(aSum,i->nb_neighbours) : type(0);
+    }
+}
+
+} // namespace Maxipix
+} // namespace lima
+
+#endif	// MAXIPIXRECONSTRUCTIONKERNELS_H
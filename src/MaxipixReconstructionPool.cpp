@@ -0,0 +1,214 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2015
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include "MaxipixReconstructionPool.h"
+
+using namespace lima;
+using namespace lima::Maxipix;
+
+//----------------------------------------------------------------------------
+//			  output buffer pool
+//----------------------------------------------------------------------------
+static const int MAXIPIX_BUFFER_ALIGN = 64;
+static const int MAXIPIX_BUFFER_POOL_MAX = 16;
+
+/** @brief a recycled buffer of size bytes, or aDstBuffer (a frame of a
+ *  batch) when given
+ */
+Buffer* MaxipixReconstruction::_BufferPool::get(int size,Buffer *aDstBuffer)
+{
+  if(aDstBuffer)
+    {
+      aDstBuffer->ref();
+      return aDstBuffer;
+    }
+  void *aDataPt = NULL;
+  {
+    AutoMutex aLock(m_lock);
+    if(size != m_size)
+      _freeAll(),m_size = size;
+    if(!m_free.empty())
+      {
+	aDataPt = m_free.back();
+	m_free.pop_back();
+      }
+    ++m_nb_out;
+  }
+
+  if(!aDataPt)
+    {
+      void *aBasePt;
+      if(posix_memalign(&aBasePt,MAXIPIX_BUFFER_ALIGN,size + MAXIPIX_BUFFER_ALIGN))
+	{
+	  AutoMutex aLock(m_lock);
+	  --m_nb_out;
+	  throw std::bad_alloc();
+	}
+      memset(aBasePt,0,size + MAXIPIX_BUFFER_ALIGN);
+      *(int*)aBasePt = size;
+      aDataPt = (char*)aBasePt + MAXIPIX_BUFFER_ALIGN;
+    }
+
+  Buffer *aBuffer = new Buffer();
+  aBuffer->owner = Buffer::MAPPED;
+  aBuffer->data = aDataPt;
+  aBuffer->callback = this;
+  return aBuffer;
+}
+
+/** @brief drop the free buffers, the ones in use are freed when given back
+ */
+void MaxipixReconstruction::_BufferPool::clear()
+{
+  AutoMutex aLock(m_lock);
+  _freeAll();
+  m_size = 0;
+}
+
+/** @brief called by the task destructor instead of delete
+ */
+void MaxipixReconstruction::_BufferPool::release()
+{
+  AutoMutex aLock(m_lock);
+  m_orphan = true;
+  if(m_nb_out)
+    return;
+  aLock.unlock();
+  delete this;
+}
+
+void MaxipixReconstruction::_BufferPool::destroy(void *dataPt)
+{
+  void *aBasePt = (char*)dataPt - MAXIPIX_BUFFER_ALIGN;
+  AutoMutex aLock(m_lock);
+  --m_nb_out;
+  if(!m_orphan && *(int*)aBasePt == m_size &&
+     int(m_free.size()) < MAXIPIX_BUFFER_POOL_MAX)
+    m_free.push_back(dataPt);
+  else
+    free(aBasePt);
+
+  if(m_orphan && !m_nb_out)
+    {
+      aLock.unlock();
+      delete this;
+    }
+}
+
+void MaxipixReconstruction::_BufferPool::_freeAll()
+{
+  for(std::vector<void*>::iterator i = m_free.begin();i != m_free.end();++i)
+    free((char*)*i - MAXIPIX_BUFFER_ALIGN);
+  m_free.clear();
+}
+
+//----------------------------------------------------------------------------
+//			  intra-frame worker pool
+//----------------------------------------------------------------------------
+MaxipixReconstruction::_WorkerPool::_WorkerPool(int nb_workers) :
+  m_job(NULL),m_nb_items(0),m_next_item(0),m_nb_done(0),
+  m_generation(0),m_quit(false)
+{
+  DEB_CONSTRUCTOR();
+  DEB_PARAM() << DEB_VAR1(nb_workers);
+
+  for(int i = 0;i < nb_workers;++i)
+    {
+      _Worker *aWorker = new _Worker(*this);
+      m_workers.push_back(aWorker);
+      aWorker->start();
+    }
+}
+
+MaxipixReconstruction::_WorkerPool::~_WorkerPool()
+{
+  DEB_DESTRUCTOR();
+  {
+    AutoMutex aLock(m_cond.mutex());
+    m_quit = true;
+    m_cond.broadcast();
+  }
+  for(std::vector<_Worker*>::iterator i = m_workers.begin();
+      i != m_workers.end();++i)
+    {
+      (*i)->join();
+      delete *i;
+    }
+}
+
+void MaxipixReconstruction::_WorkerPool::run(_Job &aJob,int nb_items)
+{
+  AutoMutex aLock(m_cond.mutex());
+  if(m_job)			// busy with another frame
+    {
+      aLock.unlock();
+      for(int i = 0;i < nb_items;++i)
+	aJob.run(i);
+      return;
+    }
+
+  m_job = &aJob;
+  m_nb_items = nb_items,m_next_item = 0,m_nb_done = 0;
+  ++m_generation;
+  m_cond.broadcast();
+
+  _runItems(aLock);
+  while(m_nb_done < m_nb_items)
+    m_cond.wait();
+  m_job = NULL;
+}
+
+/** @brief take items of the current job until there is none left
+ *
+ *  called with the pool lock held, released while an item runs.
+ */
+void MaxipixReconstruction::_WorkerPool::_runItems(AutoMutex &aLock)
+{
+  while(m_next_item < m_nb_items)
+    {
+      int item = m_next_item++;
+      _Job *aJob = m_job;
+      aLock.unlock();
+      aJob->run(item);
+      aLock.lock();
+      if(++m_nb_done == m_nb_items)
+	m_cond.broadcast();
+    }
+}
+
+void MaxipixReconstruction::_WorkerPool::_workerLoop()
+{
+  AutoMutex aLock(m_cond.mutex());
+  int aGeneration = m_generation;
+  while(!m_quit)
+    {
+      if(m_job && aGeneration != m_generation)
+	{
+	  aGeneration = m_generation;
+	  _runItems(aLock);
+	}
+      else
+	m_cond.wait();
+    }
+}
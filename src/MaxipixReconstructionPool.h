@@ -0,0 +1,120 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2015
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+#ifndef MAXIPIXRECONSTRUCTIONPOOL_H
+#define MAXIPIXRECONSTRUCTIONPOOL_H
+
+#include <vector>
+#include "MaxipixReconstruction.h"
+#include "lima/ThreadUtils.h"
+
+namespace lima {
+namespace Maxipix {
+
+//----------------------------------------------------------------------------
+//			  output buffer pool
+//----------------------------------------------------------------------------
+/** @brief recycles the buffers of the reconstructed frames
+ *
+ *  Buffers are allocated aligned, zeroed (so pre-faulted) and given back
+ *  to the pool by processlib when their last reference goes away, possibly
+ *  after the reconstruction task has been deleted: the pool is then
+ *  orphaned and deletes itself with its last buffer.
+ *  The buffer size is stored in the alignment pad in front of the data.
+ */
+class MaxipixReconstruction::_BufferPool : public Buffer::Callback
+{
+  DEB_CLASS_NAMESPC(DebModCamera, "MaxipixReconstruction", "_BufferPool");
+public:
+  _BufferPool() : m_size(0),m_nb_out(0),m_orphan(false) {}
+
+  Buffer* get(int size,Buffer *aDstBuffer = NULL);
+  void clear();
+  void release();
+
+  virtual void destroy(void *dataPt);
+private:
+  virtual ~_BufferPool() {_freeAll();}
+  void _freeAll();
+
+  Mutex m_lock;
+  int m_size;
+  int m_nb_out;
+  bool m_orphan;
+  std::vector<void*> m_free;
+};
+
+//----------------------------------------------------------------------------
+//			  intra-frame worker pool
+//----------------------------------------------------------------------------
+/** @brief part of a frame reconstruction split in independent items
+ *
+ *  run() is called once per item, from the pool threads or the caller.
+ */
+class MaxipixReconstruction::_Job
+{
+public:
+  virtual ~_Job() {}
+  virtual void run(int item) = 0;
+};
+
+/** @brief persistent threads sharing the items of one job with the caller
+ *
+ *  Only one job runs at a time: if process() is called concurrently
+ *  (several processlib threads), the other callers run their job alone.
+ */
+class MaxipixReconstruction::_WorkerPool
+{
+  DEB_CLASS_NAMESPC(DebModCamera, "MaxipixReconstruction", "_WorkerPool");
+public:
+  explicit _WorkerPool(int nb_workers);
+  ~_WorkerPool();
+
+  void run(_Job&,int nb_items);
+private:
+  class _Worker : public Thread
+  {
+  public:
+    explicit _Worker(_WorkerPool &aPool) : m_pool(aPool) {}
+  protected:
+    virtual void threadFunction() {m_pool._workerLoop();}
+  private:
+    _WorkerPool& m_pool;
+  };
+  friend class _Worker;
+
+  void _workerLoop();
+  void _runItems(AutoMutex&);
+
+  Cond m_cond;
+  std::vector<_Worker*> m_workers;
+  _Job* m_job;
+  int m_nb_items;
+  int m_next_item;
+  int m_nb_done;
+  int m_generation;
+  bool m_quit;
+};
+
+} // namespace Maxipix
+} // namespace lima
+
+#endif	// MAXIPIXRECONSTRUCTIONPOOL_H
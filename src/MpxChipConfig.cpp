@@ -21,10 +21,14 @@
 //###########################################################################
 #include <iostream>
 #include <fstream>
+#include <set>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include "lima/Debug.h"
 #include "lima/Exceptions.h"
+#include "lima/ThreadUtils.h"
 #include "MpxChipConfig.h"
 #include "MpxCommon.h"
 
@@ -33,6 +37,93 @@ using namespace lima::Maxipix;
 
 const int DEFLEN = 4;
 
+/**
+ * Read only mapping of a whole file, released on destruction
+ */
+class MappedFile {
+public:
+	MappedFile() : m_fd(-1), m_data(NULL), m_size(0) {}
+	~MappedFile() {
+		if (m_data)
+			::munmap(m_data, m_size);
+		if (m_fd != -1)
+			::close(m_fd);
+	}
+	bool open(const std::string& filename) {
+		struct stat stat_buf;
+		m_fd = ::open(filename.c_str(), O_RDONLY);
+		if (m_fd == -1 || ::fstat(m_fd, &stat_buf) != 0 || stat_buf.st_size == 0)
+			return false;
+		m_size = stat_buf.st_size;
+		void* data = ::mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (data == MAP_FAILED)
+			return false;
+		m_data = data;
+		return true;
+	}
+	const uint8_t* data() const { return static_cast<const uint8_t*>(m_data); }
+	long size() const { return m_size; }
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	int m_fd;
+	void* m_data;
+	long m_size;
+};
+
+/**
+ * Loads the files of a list of chips. Run by the thread calling
+ * MpxPixelConfig::loadConfig and by its ChipLoadWorker threads, each
+ * taking the next chip until none is left. The first error stops it.
+ */
+class ChipLoader {
+public:
+	ChipLoader(std::vector<MpxPixelArray*>& pixelArray,
+		   const std::vector<std::string>& files,
+		   const std::vector<int>& chips) :
+		m_pixelArray(pixelArray), m_files(files), m_chips(chips), m_next(0) {}
+
+	void run() {
+		AutoMutex aLock(m_lock);
+		while (m_next < m_chips.size() && m_errors.empty()) {
+			int idx = m_chips[m_next++];
+			aLock.unlock();
+			try {
+				m_pixelArray[idx]->load(m_files[idx]);
+				aLock.lock();
+			} catch (Exception& e) {
+				aLock.lock();
+				m_errors.push_back(e);
+			} catch (std::exception& e) {
+				aLock.lock();
+				m_errors.push_back(LIMA_EXC(CameraPlugin, Error, e.what()));
+			}
+		}
+	}
+	// rethrows the first error, once all the threads are joined
+	void checkError() {
+		if (!m_errors.empty())
+			throw m_errors[0];
+	}
+private:
+	std::vector<MpxPixelArray*>& m_pixelArray;
+	const std::vector<std::string>& m_files;
+	const std::vector<int>& m_chips;
+	unsigned m_next;
+	std::vector<Exception> m_errors;
+	Mutex m_lock;
+};
+
+class ChipLoadWorker : public Thread {
+public:
+	explicit ChipLoadWorker(ChipLoader& loader) : m_loader(loader) {}
+protected:
+	virtual void threadFunction() { m_loader.run(); }
+private:
+	ChipLoader& m_loader;
+};
+
 struct ArrayDefs {
 	std::string labels[DEFLEN];
 	uint8_t mask[DEFLEN];
@@ -99,11 +190,78 @@ void MpxPixelConfig::setPath(const std::string& path) {
 	}
 }
 
+/**
+ * Load name_chip_<n>.edf or .bpc for every chip. A file unchanged since
+ * it was last loaded is taken from the cache without being read, the
+ * others are loaded and decoded in parallel.
+ */
 void MpxPixelConfig::loadConfig(const std::string& name) {
 	DEB_MEMBER_FUNCT();
+	std::vector<std::string> files;
+	getConfigFiles(name, files);
+
+	std::vector<FileStamp> stamps(m_nchip);
+	std::vector<int> chips;
 	for (int idx = 0; idx < m_nchip; idx++) {
-		m_pixelArray[idx]->load(getConfigFile(name, idx + 1));
+		if (!getFileStamp(files[idx], stamps[idx])) {
+			THROW_HW_ERROR(Error) << "Cannot find file <" << files[idx] << ">";
+		}
+		std::map<std::string, FileArrays>::iterator it = m_fileCache.find(files[idx]);
+		const FileStamp& stamp = stamps[idx];
+		if (it != m_fileCache.end() && it->second.stamp.inode == stamp.inode
+				&& it->second.stamp.size == stamp.size
+				&& it->second.stamp.mtime == stamp.mtime
+				&& it->second.stamp.ctime == stamp.ctime) {
+			m_pixelArray[idx]->restoreArrays(it->second.arrays);
+		} else {
+			m_fileCache.erase(files[idx]);
+			chips.push_back(idx);
+		}
+	}
+	if (chips.empty()) {
+		trimFileCache(files);
+		return;
+	}
+
+	ChipLoader loader(m_pixelArray, files, chips);
+	std::vector<ChipLoadWorker*> workers;
+	for (unsigned i = 1; i < chips.size(); i++) {
+		ChipLoadWorker* worker = new ChipLoadWorker(loader);
+		workers.push_back(worker);
+		worker->start();
+	}
+	loader.run();
+	for (unsigned i = 0; i < workers.size(); i++) {
+		workers[i]->join();
+		delete workers[i];
+	}
+	loader.checkError();
+
+	for (unsigned i = 0; i < chips.size(); i++) {
+		int idx = chips[i];
+		FileArrays& entry = m_fileCache[files[idx]];
+		entry.stamp = stamps[idx];
+		m_pixelArray[idx]->saveArrays(entry.arrays);
+	}
+	trimFileCache(files);
+}
+
+/**
+ * Keep in the cache the files of this load and of the previous one only.
+ */
+void MpxPixelConfig::trimFileCache(const std::vector<std::string>& files) {
+	DEB_MEMBER_FUNCT();
+	std::set<std::string> kept(files.begin(), files.end());
+	kept.insert(m_lastFiles.begin(), m_lastFiles.end());
+	std::map<std::string, FileArrays>::iterator it = m_fileCache.begin();
+	while (it != m_fileCache.end()) {
+		if (kept.count(it->first)) {
+			++it;
+		} else {
+			m_fileCache.erase(it++);
+		}
 	}
+	m_lastFiles = files;
 }
 
 void MpxPixelConfig::getMpxString(int chipid, std::string& mpxString) {
@@ -177,22 +335,75 @@ void MpxPixelConfig::setHigh2Min(int chipid) {
 	}
 }
 
-std::string MpxPixelConfig::getConfigFile(const std::string& name, int chip) {
+void MpxPixelConfig::getVersion(Version& version) {
+	DEB_MEMBER_FUNCT();
+	version = m_version;
+}
+
+void MpxPixelConfig::getNChips(int& nchip) {
+	DEB_MEMBER_FUNCT();
+	nchip = m_nchip;
+}
+
+/**
+ * Config file of every chip, EDF preferred to BPC. The directory is read
+ * once instead of probing each possible file.
+ */
+void MpxPixelConfig::getConfigFiles(const std::string& name, std::vector<std::string>& files) {
 	DEB_MEMBER_FUNCT();
 	std::string ext[] = { "edf", "bpc" };
 	std::stringstream ss;
 	if (!m_path.empty()) {
 		ss << m_path << "/";
 	}
-	ss << name << "_chip_" << chip << ".";
+	ss << name << "_chip_";
 	std::string root = ss.str();
-	std::string fname;
-	for (int i = 0; i < 2; i++) {
-		fname = root + ext[i];
-		if (access(fname.c_str(), F_OK) != -1)
-			return std::string(fname);
+	std::string::size_type slash = root.rfind('/');
+	std::string dirname = ".";
+	if (slash != std::string::npos) {
+		dirname = (slash == 0) ? "/" : root.substr(0, slash);
+	}
+	std::string prefix = root.substr(slash == std::string::npos ? 0 : slash + 1);
+
+	std::set<std::string> entries;
+	DIR* dir = opendir(dirname.c_str());
+	if (dir) {
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL) {
+			if (::strncmp(entry->d_name, prefix.c_str(), prefix.length()) == 0)
+				entries.insert(entry->d_name);
+		}
+		closedir(dir);
+	}
+
+	files.clear();
+	for (int chip = 1; chip <= m_nchip; chip++) {
+		std::stringstream chipName;
+		chipName << prefix << chip << ".";
+		std::string fname;
+		for (int i = 0; i < 2 && fname.empty(); i++) {
+			if (entries.count(chipName.str() + ext[i]))
+				fname = root.substr(0, root.length() - prefix.length())
+						+ chipName.str() + ext[i];
+		}
+		if (fname.empty()) {
+			THROW_HW_ERROR(Error) << "No config file found for <" << root << chip << ".*>";
+		}
+		files.push_back(fname);
+	}
+}
+
+bool MpxPixelConfig::getFileStamp(const std::string& filename, FileStamp& stamp) {
+	DEB_MEMBER_FUNCT();
+	struct stat stat_buf;
+	if (::stat(filename.c_str(), &stat_buf) != 0) {
+		return false;
 	}
-	THROW_HW_ERROR(Error) << "No config file found for <" << root << "*>";
+	stamp.inode = stat_buf.st_ino;
+	stamp.size = stat_buf.st_size;
+	stamp.mtime = int64_t(stat_buf.st_mtim.tv_sec) * 1000000000 + stat_buf.st_mtim.tv_nsec;
+	stamp.ctime = int64_t(stat_buf.st_ctim.tv_sec) * 1000000000 + stat_buf.st_ctim.tv_nsec;
+	return true;
 }
 
 /**
@@ -204,6 +415,8 @@ std::string MpxPixelConfig::getConfigFile(const std::string& name, int chip) {
 MpxPixelArray::MpxPixelArray(Version& version, std::string& filename) {
 	DEB_CONSTRUCTOR();
 	m_version = version;
+	m_mpxHash = 0;
+	m_mpxDirty = true;
 	int idx = static_cast<int>(version);
 	for (int i=0; i<DEFLEN; i++) {
 	  m_arrayLabels[i] = m_arrayDefs[idx].labels[i];
@@ -236,16 +449,40 @@ void MpxPixelArray::reset() {
 }
 
 /**
- * Conversion into string needed for Priam transfer
+ * Conversion into string needed for Priam transfer.
+ * The encoded string is cached: it is only rebuilt when an array was
+ * modified since the last call and its content hash has changed, so
+ * reloading or reapplying the same configuration does not re-encode.
  */
 void MpxPixelArray::getMpxString(std::string& mpxString) {
 	DEB_MEMBER_FUNCT();
-	PixelConfigArray array = PixelConfigArray(m_version);
-	array.maskArray = m_arrays[MASK];
-	array.testArray = m_arrays[TEST];
-	array.lowArray = m_arrays[LOW];
-	array.highArray = m_arrays[HIGH];
-	array.convert(mpxString);
+	if (m_mpxDirty) {
+		uint64_t hash = contentHash();
+		if (m_mpxString.empty() || hash != m_mpxHash) {
+			PixelConfigArray array = PixelConfigArray(m_version);
+			array.maskArray = m_arrays[MASK];
+			array.testArray = m_arrays[TEST];
+			array.lowArray = m_arrays[LOW];
+			array.highArray = m_arrays[HIGH];
+			array.convert(m_mpxString);
+			m_mpxHash = hash;
+		}
+		m_mpxDirty = false;
+	}
+	mpxString = m_mpxString;
+}
+
+/**
+ * Hash of the four arrays
+ */
+uint64_t MpxPixelArray::contentHash() {
+	DEB_MEMBER_FUNCT();
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	uint64_t hash = CONTENT_HASH_SEED;
+	for (int idx = 0; idx < DEFLEN; idx++) {
+		hash = Maxipix::contentHash(m_arrays[idx], size, hash);
+	}
+	return hash;
 }
 
 /**
@@ -291,51 +528,40 @@ void MpxPixelArray::load(const std::string& filename) {
 }
 
 /**
- * Load a config file in BPC format (pixelman)
+ * Load a config file in BPC format (pixelman).
+ * The file is mapped and the four arrays are extracted in one pass.
  */
 void MpxPixelArray::loadBpc(const std::string& filename) {
 	DEB_MEMBER_FUNCT();
-	int fd;
-	try {
-		fd = open(filename.c_str(), O_RDONLY);
-	} catch (Exception& e) {
+	MappedFile file;
+	if (!file.open(filename)) {
 		THROW_HW_ERROR(Error) << "Cannot open <" << filename << "> for reading";
 	}
-	int size = ChipSize.getWidth() * ChipSize.getHeight();
-	uint8_t* data = new (std::nothrow) uint8_t[size];
-	if (!data) {
-		THROW_HW_ERROR(Error) << "Insufficient memory for loading file " << filename;
-	}
-	int nbytes = read(fd, data, size);
-	close(fd);
-
-	if (nbytes != size) {
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	if (file.size() < size) {
 		THROW_HW_ERROR(Error) << "<" << filename << "> has not the correct size";
 	}
-	uint8_t* shift = m_arrayDefs[m_version].bpcShift;
-	reset();
-	uint8_t* dataout = new (std::nothrow) uint8_t[size];
-	if (!dataout) {
-		THROW_HW_ERROR(Error) << "Insufficient memory for loading file " << filename;
-	}
-	for (int i = 0; i < size; i++) {
-		dataout[i] = (data[i] >> shift[MASK]) & m_arrayMask[MASK];
-	}
-	setMaskArray(dataout);
-	for (int i = 0; i < size; i++) {
-		dataout[i] = (data[i] >> shift[TEST]) & m_arrayMask[TEST];
-	}
-	setTestArray(dataout);
-	for (int i = 0; i < size; i++) {
-		dataout[i] = (data[i] >> shift[HIGH]) & m_arrayMask[HIGH];
-	}
-	setHighArray(dataout);
-	for (int i = 0; i < size; i++) {
-		dataout[i] = data[i] & m_arrayMask[LOW];
-	}
-	setLowArray(dataout);
-	delete[] data;
-	delete[] dataout;
+	// 8 pixels at a time: each field fits in its byte once shifted, so
+	// a byte wide mask drops the bits shifted in from the next pixel
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint8_t* data = file.data();
+	const uint8_t* shift = m_arrayDefs[m_version].bpcShift;
+	int maskShift = shift[MASK], testShift = shift[TEST], highShift = shift[HIGH];
+	uint64_t maskMask = m_arrayMask[MASK] * ones, testMask = m_arrayMask[TEST] * ones;
+	uint64_t lowMask = m_arrayMask[LOW] * ones, highMask = m_arrayMask[HIGH] * ones;
+	for (long i = 0; i < size; i += 8) {
+		uint64_t d, v;
+		::memcpy(&d, data + i, sizeof(d));
+		v = (d >> maskShift) & maskMask;
+		::memcpy(m_arrays[MASK] + i, &v, sizeof(v));
+		v = (d >> testShift) & testMask;
+		::memcpy(m_arrays[TEST] + i, &v, sizeof(v));
+		v = (d >> highShift) & highMask;
+		::memcpy(m_arrays[HIGH] + i, &v, sizeof(v));
+		v = d & lowMask;
+		::memcpy(m_arrays[LOW] + i, &v, sizeof(v));
+	}
+	m_mpxDirty = true;
 }
 
 /**
@@ -364,39 +590,32 @@ void MpxPixelArray::saveBpc(const std::string& filename) {
 }
 
 /**
- *
+ * Load a config file in EDF format: 4 images, each a 1024 bytes header
+ * ending with '}' followed by the uint8_t chip array. The file is mapped
+ * and each image copied straight into its array.
  */
 void MpxPixelArray::loadEdf(const std::string& filename) {
 	DEB_MEMBER_FUNCT();
-	//Assumptions: As we save the header in 1024 bytes we will only read a header of that size
-	// but at least test to check for the '}'. The data type will be uint8_t and size determined
-	// by the chipsize.
-	int headerSize = 1024;
-	std::ifstream file(filename.c_str(), std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
-	if (file.is_open()) {
-		long fileSize = file.tellg();
-		file.seekg(0, std::ios::beg);
-		if (fileSize != 4 * headerSize * ChipSize.getWidth() * ChipSize.getHeight()) {
-			THROW_HW_ERROR(Error) << "<" << filename << "> does not contain 4 images";
-		}
-		reset();
-		char *hdr = new char[headerSize];
-		long size = ChipSize.getWidth() * ChipSize.getHeight();
-		uint8_t *data = new uint8_t[size];
-		for (int idx = 0; idx < 4; idx++) {
-			file.read(hdr, headerSize);
-			if (hdr[1022] == '}') {
-				THROW_HW_ERROR(Error) << "<" << filename << "> is not in EDF format";
-			}
-			file.read((char*) data, size);
-			setArray(idx, data);
-		}
-		file.close();
-		delete[] hdr;
-		delete[] data;
-	} else {
+	const long headerSize = 1024;
+	MappedFile file;
+	if (!file.open(filename)) {
 		THROW_HW_ERROR(Error) << "Unable to open file <" << filename << ">";
 	}
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	if (file.size() != 4 * (headerSize + size)) {
+		THROW_HW_ERROR(Error) << "<" << filename << "> does not contain 4 images";
+	}
+	const uint8_t* image = file.data();
+	for (int idx = 0; idx < 4; idx++, image += headerSize + size) {
+		if (image[0] != '{' || image[headerSize - 2] != '}') {
+			THROW_HW_ERROR(Error) << "<" << filename << "> is not in EDF format";
+		}
+	}
+	image = file.data();
+	for (int idx = 0; idx < 4; idx++, image += headerSize + size) {
+		::memcpy(m_arrays[idx], image + headerSize, size);
+	}
+	m_mpxDirty = true;
 }
 
 /**
@@ -428,6 +647,7 @@ void MpxPixelArray::saveEdf(const std::string& filename) {
 			for (int i = 0; i < ssize; i++)
 				header << " ";
 		header << "}\n";
+		fout << header.str();
 		fout.write((char*) m_arrays[idx],
 				ChipSize.getWidth() * ChipSize.getHeight());
 	}
@@ -440,31 +660,23 @@ void MpxPixelArray::saveEdf(const std::string& filename) {
 void MpxPixelArray::loadMask(const std::string& filename) {
 	DEB_MEMBER_FUNCT();
 	//Assumptions: As we save the mask header in 1024 bytes we will only read a header of that size
-	// but at least test to check for the '}'. The data type will be uint8_t and size determined
+	// but at least test to check for the '{' and '}'. The data type will be uint8_t and size determined
 	// by the chipsize.
-	int headerSize = 1024;
-	std::ifstream file(filename.c_str(), std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
-	if (file.is_open()) {
-		long fileSize = file.tellg();
-		file.seekg(0, std::ios::beg);
-		if (fileSize != headerSize * ChipSize.getWidth() * ChipSize.getHeight())
-			THROW_HW_ERROR(Error) << "<" << filename << "> does not contain 4 images";
-		resetMaskArray();
-		char *hdr = new char[headerSize];
-		long size = ChipSize.getWidth() * ChipSize.getHeight();
-		uint8_t *data = new uint8_t[size];
-		file.read(hdr, headerSize);
-		if (hdr[1022] == '}') {
-			THROW_HW_ERROR(Error) << "<" << filename << "> is not in EDF format";
-		}
-		file.read((char*) data, size);
-		setMaskArray(data);
-		file.close();
-		delete[] hdr;
-		delete[] data;
-	} else {
+	const long headerSize = 1024;
+	MappedFile file;
+	if (!file.open(filename)) {
 		THROW_HW_ERROR(Error) << "Unable to open file <" << filename << ">";
 	}
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	if (file.size() != headerSize + size) {
+		THROW_HW_ERROR(Error) << "<" << filename << "> does not contain 1 image";
+	}
+	const uint8_t* image = file.data();
+	if (image[0] != '{' || image[headerSize - 2] != '}') {
+		THROW_HW_ERROR(Error) << "<" << filename << "> is not in EDF format";
+	}
+	::memcpy(m_arrays[MASK], image + headerSize, size);
+	m_mpxDirty = true;
 }
 
 /**
@@ -497,6 +709,7 @@ void MpxPixelArray::saveMask(const std::string& filename) {
 		}
 	}
 	header << "}\n";
+	fout << header.str();
 	fout.write((char*) getMaskArray(), ChipSize.getWidth() * ChipSize.getHeight());
 	fout.close();
 }
@@ -565,6 +778,7 @@ void MpxPixelArray::setHigh2Min() {
 
 void MpxPixelArray::setArrayValue(int index, uint8_t value) {
 	DEB_MEMBER_FUNCT();
+	m_mpxDirty = true;
 	::memset(m_arrays[index], value, ChipSize.getWidth() * ChipSize.getHeight());
 }
 
@@ -615,6 +829,7 @@ void MpxPixelArray::setHighArray(uint8_t* data) {
 
 void MpxPixelArray::setArray(int index, uint8_t* data) {
 	DEB_MEMBER_FUNCT();
+	m_mpxDirty = true;
 	long size = ChipSize.getWidth() * ChipSize.getHeight();
 	for (int idx = 0; idx < size; idx++) {
 		m_arrays[index][idx] |= (data[idx]);
@@ -643,6 +858,28 @@ void MpxPixelArray::resetHighArray() {
 
 void MpxPixelArray::resetArray(int index) {
 	DEB_MEMBER_FUNCT();
+	m_mpxDirty = true;
 	::memset(m_arrays[index], 0, ChipSize.getWidth() * ChipSize.getHeight());
 }
 
+/**
+ * Copy of the four arrays one after the other
+ */
+void MpxPixelArray::saveArrays(std::vector<uint8_t>& data) {
+	DEB_MEMBER_FUNCT();
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	data.resize(DEFLEN * size);
+	for (int idx = 0; idx < DEFLEN; idx++) {
+		::memcpy(&data[idx * size], m_arrays[idx], size);
+	}
+}
+
+void MpxPixelArray::restoreArrays(const std::vector<uint8_t>& data) {
+	DEB_MEMBER_FUNCT();
+	long size = ChipSize.getWidth() * ChipSize.getHeight();
+	m_mpxDirty = true;
+	for (int idx = 0; idx < DEFLEN; idx++) {
+		::memcpy(m_arrays[idx], &data[idx * size], size);
+	}
+}
+
@@ -22,6 +22,7 @@
 
 #include <sstream>
 #include <cstdio>
+#include <cstring>
 #include <errno.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -73,6 +74,25 @@ bool checkPath(std::string path) {
 	return false;
 }
 
+/**
+ * 64 bits hash of size bytes, read 8 at a time. Chaining calls with the
+ * returned value hashes several buffers as one.
+ */
+uint64_t contentHash(const void* data, long size, uint64_t hash) {
+	const uint8_t* bytes = static_cast<const uint8_t*>(data);
+	long i;
+	for (i = 0; i + 8 <= size; i += 8) {
+		uint64_t word;
+		::memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	for (; i < size; i++) {
+		hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
 const string convert_2_string(const Version& version) {
 	string name;
 	switch (version) {
@@ -171,6 +191,7 @@ const string convert_2_string(const MaxipixReconstruction::Layout& layout) {
 	case MaxipixReconstruction::L_5x1: name = "L_5X1"; break;
 	case MaxipixReconstruction::L_FREE: name = "L_FREE"; break;
 	case MaxipixReconstruction::L_GENERAL: name = "L_GENERAL"; break;
+	case MaxipixReconstruction::L_GRID: name = "L_GRID"; break;
 	default: name = "Unknown"; break;
 	}
 	return name;
@@ -189,6 +210,8 @@ void convert_from_string(const std::string& val, MaxipixReconstruction::Layout&
 		layout = MaxipixReconstruction::L_FREE;
 	} else if (buffer == "L_GENERAL") {
 		layout = MaxipixReconstruction::L_GENERAL;
+	} else if (buffer == "L_GRID") {
+		layout = MaxipixReconstruction::L_GRID;
 	} else {
 		std::stringstream msg;
 		msg << "MaxipixReconstruction::Layout can't be:" << DEB_VAR1(val);
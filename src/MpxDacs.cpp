@@ -716,6 +716,8 @@ void MpxDacs::applyChipDacs(int chipid) {
 
 	std::string sfsr;
 	if (chipid == 0) {
+		// always written: the FSR answer is the chip ID readback, which
+		// drops the pixel matrix record of a swapped chip
 		for (int idx = 0; idx < m_nchip; idx++) {
 			getFsrString(idx + 1, sfsr);
 			std::cout << "Loading Chip FSR #" << idx+1 << " ..." << std::endl;
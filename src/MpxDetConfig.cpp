@@ -184,6 +184,23 @@ void MpxDetConfig::parseLayoutSection(INIReader& reader) {
 			}
 		}
 
+	// layout paramters for any regular grid of chips, read line by line
+	// from the top left one
+	} else if (m_layout == MaxipixReconstruction::L_GRID) {
+	        Range<int> chipsRange = Range<int>(1, m_nchips);
+		getMandatoryParam(reader, section, "xchips", m_xchips, chipsRange);
+		getMandatoryParam(reader, section, "ychips", m_ychips, chipsRange);
+		if (m_xchips * m_ychips != m_nchips) {
+			THROW_HW_ERROR(Error) << "Layout is L_GRID but in <detmodule> section nchips != xchips * ychips";
+		}
+	        Range<int> gapRange = Range<int>(0,4);
+		getMandatoryParam(reader, section, "xgap", m_xgap, gapRange);
+		if (m_ychips > 1) {
+		        getMandatoryParam(reader, section, "ygap", m_ygap, gapRange);
+		} else {
+		        m_ygap = 0;
+		}
+
 	// layout paramters for general reconstruction, position  are mandatory
 	// included L_FREE, a faster reconstruction when there is only rotation on chips
 	} else if (m_layout == MaxipixReconstruction::L_GENERAL || m_layout == MaxipixReconstruction::L_FREE) {
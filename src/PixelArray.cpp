@@ -20,6 +20,7 @@
 // along with this program; if not, see <http://www.gnu.org/licenses/>.
 //###########################################################################
 
+#include <string.h>
 #include "PixelArray.h"
 #include "lima/Debug.h"
 #include "lima/Exceptions.h"
@@ -101,20 +102,33 @@ PixelConfigArray::PixelConfigArray(Version version) :
 	};
 }
 
+// 8 consecutive pixels, pixel i in byte i
+static inline uint64_t loadPixels(const unsigned char *pixels) {
+	return uint64_t(pixels[0]) | uint64_t(pixels[1]) << 8 |
+		uint64_t(pixels[2]) << 16 | uint64_t(pixels[3]) << 24 |
+		uint64_t(pixels[4]) << 32 | uint64_t(pixels[5]) << 40 |
+		uint64_t(pixels[6]) << 48 | uint64_t(pixels[7]) << 56;
+}
+
+// one bit of 8 pixels loaded by loadPixels packed in a byte, pixel i to bit i
+static inline unsigned char packPixelBit(uint64_t pixels, int bit) {
+	pixels = (pixels >> bit) & 0x0101010101010101ULL;
+	// moves bit 8i to bit 56 + i, the shifted copies never overlap
+	return (unsigned char) ((pixels * 0x0102040810204080ULL) >> 56);
+}
+
+// each row is 14 bit planes of 32 bytes, see PixelDataArray::convert. Each
+// byte of a plane is packed from 8 pixels at a time, the 4 arrays being
+// read once for all the planes.
 void PixelConfigArray::convert(string& buffer) {
-	char maskBit[4];
 	int size, base, baseMask, baseTest, baseLow[4], baseHigh[4];
-	int ib, irow, wcol, wbit, idx, val;
-	bool is_tpx;
+	int ib, irow, wcol, idx;
 	int nrow = ChipSize.getHeight();
 	int ncol = ChipSize.getWidth();
 
-	is_tpx = (m_version == Maxipix::TPX1);
 	size = (ncol * nrow * 14) / 8;
 	buffer.assign(size, (char) 0x00);
-
-	for (ib = 0; ib < 4; ib++)
-		maskBit[ib] = 1 << ib;
+	unsigned char *planes = (unsigned char*) &buffer[0];
 
 	for (irow = 0; irow < nrow; irow++) {
 
@@ -127,47 +141,60 @@ void PixelConfigArray::convert(string& buffer) {
 			baseHigh[ib] = base + 32 * (13 - m_bit.high[ib]);
 
 		for (wcol = 0; wcol < 32; wcol++) {
-			for (wbit = 0; wbit < 8; wbit++) {
-				idx = (irow * ncol) + 255 - (wcol * 8 + wbit);
-				val = 1 << (7 - wbit);
-
-				if (maskArray[idx] & maskBit[0])
-					buffer[baseMask + wcol] |= val;
-				if (testArray[idx] & maskBit[0])
-					buffer[baseTest + wcol] |= val;
-
-				for (ib = 0; ib < m_bit.nbLow; ib++) {
-					if (lowArray[idx] & maskBit[ib])
-						buffer[baseLow[ib] + wcol] |= val;
-				}
-				for (ib = 0; ib < m_bit.nbHigh; ib++) {
-					if (highArray[idx] & maskBit[ib])
-						buffer[baseHigh[ib] + wcol] |= val;
-				}
-			}
+			idx = (irow * ncol) + 248 - wcol * 8;
+			uint64_t low = loadPixels(lowArray + idx);
+			uint64_t high = loadPixels(highArray + idx);
+
+			planes[baseMask + wcol] |= packPixelBit(loadPixels(maskArray + idx), 0);
+			planes[baseTest + wcol] |= packPixelBit(loadPixels(testArray + idx), 0);
+			for (ib = 0; ib < m_bit.nbLow; ib++)
+				planes[baseLow[ib] + wcol] |= packPixelBit(low, ib);
+			for (ib = 0; ib < m_bit.nbHigh; ib++)
+				planes[baseHigh[ib] + wcol] |= packPixelBit(high, ib);
 		}
 	}
 }
 
 PixelDataArray::PixelDataArray(){}
 
+// pixel bits of one byte of a bit plane: bit b goes to the lowest bit of
+// the 16 bits lane b, the lanes being in memory order so that the 8
+// pixels are stored as they are
+struct PixelBitLanes {
+	uint64_t lanes[256][2];
+
+	PixelBitLanes() {
+		for (int byte = 0; byte < 256; byte++) {
+			unsigned short pixels[8];
+			for (int bit = 0; bit < 8; bit++)
+				pixels[bit] = (byte >> bit) & 1;
+			memcpy(lanes[byte], pixels, sizeof(pixels));
+		}
+	}
+};
+
+static const PixelBitLanes pixelBitLanes;
+
+// each row is 14 bit planes of 32 bytes, most significant bit first. Bit b
+// of byte wcol of a plane belongs to pixel 248 - 8 * wcol + b of the row:
+// the 8 pixels of a byte are decoded together, one table look-up per plane.
 void PixelDataArray::convert(const string& buffer, unsigned short *data) {
-	int row, dbit, wcol, dcol, wbit;
+	int row, dbit, wcol;
 	int nrow = ChipSize.getHeight();
 	int ncol = ChipSize.getWidth();
-
-	memset(data, 0, ncol * nrow * sizeof(unsigned short));
-
-	for (row = 0; row < nrow; row++) {
-		for (dbit = 0; dbit < 14; dbit++) {
-			for (wcol = 0; wcol < 32; wcol++) {
-				for (wbit = 7; wbit >= 0; wbit--) {
-					dcol = 255 - (wcol * 8 + wbit);
-					if (buffer[row * 14 * 32 + dbit * 32 + wcol] & (1 << (7 - wbit))) {
-						data[row * ncol + dcol] |= (1 << (13 - dbit));
-					}
-				}
+	const unsigned char *planes = (const unsigned char*) buffer.data();
+
+	for (row = 0; row < nrow; row++, planes += 14 * 32) {
+		unsigned short *pixels = data + row * ncol + ncol - 8;
+		for (wcol = 0; wcol < 32; wcol++, pixels -= 8) {
+			uint64_t low = 0, high = 0;
+			for (dbit = 0; dbit < 14; dbit++) {
+				const uint64_t *lanes = pixelBitLanes.lanes[planes[dbit * 32 + wcol]];
+				low |= lanes[0] << (13 - dbit);
+				high |= lanes[1] << (13 - dbit);
 			}
+			memcpy(pixels, &low, sizeof(low));
+			memcpy(pixels + 4, &high, sizeof(high));
 		}
 	}
 }
@@ -42,6 +42,7 @@ PriamAcq::PriamAcq(PriamSerial& priam_serial)
     DEB_CONSTRUCTOR();
 
     m_chip_id.resize(maxPorts,0);
+    m_chip_cfg_hash.resize(maxPorts,0);
     m_port_used.push_back(0);
 
     setTimeUnit(UNIT_MS);
@@ -278,6 +279,7 @@ void PriamAcq::setChipFsr(short port,const string &fsr)
     DEB_PARAM() << DEB_VAR2(port,fsrString);
 
     string sdummy, sid;
+    long prev_id= m_chip_id[port];
 
     enableSerial(port);
     sdummy.append(32, '\xff');
@@ -286,6 +288,9 @@ void PriamAcq::setChipFsr(short port,const string &fsr)
     m_chip_id[port]= 0;
     for (int i=0; i<3; i++)
 	m_chip_id[port] |= ((sid.at(i)&0xff)<<i);
+    // -- another chip answers on this port: its matrix is unknown
+    if (m_chip_id[port] != prev_id)
+	m_chip_cfg_hash[port]= 0;
     if (port==0)
 	m_chip_fsr0= fsr;
 }
@@ -307,12 +312,37 @@ void PriamAcq::setChipCfg(short port,const string &cfg)
 
     string out;
     enableSerial(port);
+    m_chip_cfg_hash[port]= 0;
     m_priam_serial.writeMatrix(cfg);
+    m_chip_cfg_hash[port]= contentHash(cfg.data(), cfg.size());
     // due to espia serial timeout we do not serialread here (for reseting chip infact)
     // but instead the chip(s) will be acquired by the calling function
     //m_priam_serial.readMatrix(out);
 }
 
+// -- true if cfg is the matrix the last setChipCfg() wrote on port
+bool PriamAcq::isChipCfgLoaded(short port,const string &cfg) const
+{
+    DEB_MEMBER_FUNCT();
+    DEB_PARAM() << DEB_VAR1(port);
+
+    _checkPortNr(port);
+    bool loaded= m_chip_cfg_hash[port] &&
+		(m_chip_cfg_hash[port] == contentHash(cfg.data(), cfg.size()));
+    DEB_RETURN() << DEB_VAR1(loaded);
+    return loaded;
+}
+
+// -- forget what was written on port, next apply will send everything
+void PriamAcq::invalidateChip(short port)
+{
+    DEB_MEMBER_FUNCT();
+    DEB_PARAM() << DEB_VAR1(port);
+
+    _checkPortNr(port);
+    m_chip_cfg_hash[port]= 0;
+}
+
 void PriamAcq::setTimeUnit(TimeUnit unit)
 {
     DEB_MEMBER_FUNCT();
@@ -864,6 +894,7 @@ void PriamAcq::resetChip(short port)
 
     _checkPortNr(port);
 
+    invalidateChip(port);
     val= 0x80 | 0x20 | (1<<port);
     sval= string(1, val);
     m_priam_serial.writeRegister(PriamSerial::PR_MCR2, sval);
@@ -0,0 +1,240 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2017
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+// Priam matrix format benchmark, no detector needed.
+//
+// usage: test_maxipix_pixel_array_bench [--json] [--chips n]
+//
+// Decodes n seeded random chip matrices (14 bit planes per row) with
+// PixelDataArray::convert and encodes n random pixel configurations for
+// each chip version with PixelConfigArray::convert. Both are checked
+// against the original one bit at a time loops, and the chips done per
+// second by each are printed.
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include "PixelArray.h"
+#include "lima/Timestamp.h"
+
+using namespace lima;
+using namespace lima::Maxipix;
+using namespace std;
+
+static const int NB_CHIP_PIXEL = 256 * 256;
+static const int MATRIX_SIZE = NB_CHIP_PIXEL * 14 / 8;
+
+// the decoder PixelDataArray::convert replaced
+static void reference_convert(const string& buffer, unsigned short *data)
+{
+	memset(data, 0, NB_CHIP_PIXEL * sizeof(unsigned short));
+	for (int row = 0; row < 256; row++)
+		for (int dbit = 0; dbit < 14; dbit++)
+			for (int wcol = 0; wcol < 32; wcol++)
+				for (int wbit = 7; wbit >= 0; wbit--) {
+					int dcol = 255 - (wcol * 8 + wbit);
+					if (buffer[row * 14 * 32 + dbit * 32 + wcol] & (1 << (7 - wbit)))
+						data[row * 256 + dcol] |= (1 << (13 - dbit));
+				}
+}
+
+// the encoder PixelConfigArray::convert replaced, bits as set by the
+// PixelConfigArray constructor
+struct ReferenceBits {
+	short mask;
+	short test;
+	short nbLow;
+	short low[4];
+	short nbHigh;
+	short high[4];
+};
+
+static const ReferenceBits reference_bits[] = {
+	{0, 1, 3, {4, 3, 2, -1}, 3, {7, 6, 5, -1}},		// DUMMY
+	{11, 10, 3, {9, 8, 7, -1}, 3, {12, 5, 4, -1}},		// MPX2
+	{0, 9, 3, {7, 6, 8, -1}, 3, {12, 10, 11, -1}},		// MXR2
+	{7, 13, 4, {8, 12, 10, 11}, 2, {9, 6, -1, -1}},		// TPX1
+};
+
+static void reference_convert(Version version, const unsigned char *const arrays[4],
+			      string& buffer)
+{
+	const ReferenceBits& bits = reference_bits[version];
+	buffer.assign(MATRIX_SIZE, (char) 0x00);
+	for (int irow = 0; irow < 256; irow++) {
+		int base = irow * 14 * 32;
+		for (int wcol = 0; wcol < 32; wcol++)
+			for (int wbit = 0; wbit < 8; wbit++) {
+				int idx = (irow * 256) + 255 - (wcol * 8 + wbit);
+				int val = 1 << (7 - wbit);
+				if (arrays[0][idx] & 1)
+					buffer[base + 32 * (13 - bits.mask) + wcol] |= val;
+				if (arrays[1][idx] & 1)
+					buffer[base + 32 * (13 - bits.test) + wcol] |= val;
+				for (int ib = 0; ib < bits.nbLow; ib++)
+					if (arrays[2][idx] & (1 << ib))
+						buffer[base + 32 * (13 - bits.low[ib]) + wcol] |= val;
+				for (int ib = 0; ib < bits.nbHigh; ib++)
+					if (arrays[3][idx] & (1 << ib))
+						buffer[base + 32 * (13 - bits.high[ib]) + wcol] |= val;
+			}
+	}
+}
+
+static const char* version_name(Version version)
+{
+	switch (version) {
+	case DUMMY: return "DUMMY";
+	case MPX2: return "MPX2";
+	case MXR2: return "MXR2";
+	default: return "TPX1";
+	}
+}
+
+// chips decoded per second
+static double run(bool reference, const vector<string>& matrices,
+		  vector<unsigned short>& pixels)
+{
+	PixelDataArray array;
+	int nb_chips = matrices.size();
+	double start = Timestamp::now();
+	for (int i = 0; i < nb_chips; ++i) {
+		if (reference)
+			reference_convert(matrices[i], &pixels[i * NB_CHIP_PIXEL]);
+		else
+			array.convert(matrices[i], &pixels[i * NB_CHIP_PIXEL]);
+	}
+	double elapsed = double(Timestamp::now()) - start;
+	return nb_chips / elapsed;
+}
+
+// chips encoded per second, arrays holds mask, test, low and high of each chip
+static double run_encode(bool reference, Version version,
+			 const vector<unsigned char>& arrays, vector<string>& matrices)
+{
+	PixelConfigArray array(version);
+	int nb_chips = matrices.size();
+	double start = Timestamp::now();
+	for (int i = 0; i < nb_chips; ++i) {
+		const unsigned char *chip = &arrays[i * 4 * NB_CHIP_PIXEL];
+		const unsigned char *chip_arrays[4] = {
+			chip, chip + NB_CHIP_PIXEL, chip + 2 * NB_CHIP_PIXEL,
+			chip + 3 * NB_CHIP_PIXEL
+		};
+		if (reference)
+			reference_convert(version, chip_arrays, matrices[i]);
+		else {
+			array.maskArray = (unsigned char*) chip_arrays[0];
+			array.testArray = (unsigned char*) chip_arrays[1];
+			array.lowArray = (unsigned char*) chip_arrays[2];
+			array.highArray = (unsigned char*) chip_arrays[3];
+			array.convert(matrices[i]);
+		}
+	}
+	double elapsed = double(Timestamp::now()) - start;
+	return nb_chips / elapsed;
+}
+
+static void print(bool json, bool& first, const string& operation,
+		  const string& version, double reference_rate, double rate,
+		  bool same)
+{
+	if (json) {
+		if (!first)
+			cout << "," << endl;
+		cout << "  {\"operation\": \"" << operation << "\", \"version\": \""
+		     << version << "\", \"reference_chips_per_s\": " << fixed
+		     << setprecision(1) << reference_rate << ", \"chips_per_s\": "
+		     << rate << ", \"same\": " << (same ? "true" : "false") << "}";
+	} else
+		cout << setw(10) << operation << setw(9) << version << fixed
+		     << setprecision(1) << setw(14) << reference_rate
+		     << setw(14) << rate << setw(6) << (same ? "yes" : "NO") << endl;
+	first = false;
+}
+
+int main(int argc, char *argv[])
+{
+	bool json = false;
+	int nb_chips = 200;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--json")
+			json = true;
+		else if (arg == "--chips" && i + 1 < argc)
+			nb_chips = atoi(argv[++i]);
+		else {
+			cerr << "usage: " << argv[0] << " [--json] [--chips n]" << endl;
+			return 1;
+		}
+	}
+	if (nb_chips < 1) {
+		cerr << "invalid number of chips" << endl;
+		return 1;
+	}
+
+	srand(1234);
+	vector<string> matrices(nb_chips);
+	for (int i = 0; i < nb_chips; ++i) {
+		matrices[i].resize(MATRIX_SIZE);
+		for (int j = 0; j < MATRIX_SIZE; ++j)
+			matrices[i][j] = char(rand());
+	}
+
+	vector<unsigned char> arrays(nb_chips * 4 * NB_CHIP_PIXEL);
+	for (size_t i = 0; i < arrays.size(); ++i)
+		arrays[i] = (unsigned char) rand();
+
+	if (json)
+		cout << "{\"chips\": " << nb_chips << ", \"results\": [" << endl;
+	else
+		cout << setw(10) << "operation" << setw(9) << "version"
+		     << setw(14) << "reference/s" << setw(14) << "chips/s"
+		     << setw(6) << "same" << endl;
+
+	bool first = true;
+	bool all_same = true;
+	vector<unsigned short> expected(nb_chips * NB_CHIP_PIXEL);
+	vector<unsigned short> decoded(nb_chips * NB_CHIP_PIXEL);
+	double reference_rate = run(true, matrices, expected);
+	double rate = run(false, matrices, decoded);
+	bool same = expected == decoded;
+	print(json, first, "decode", "", reference_rate, rate, same);
+	all_same = all_same && same;
+
+	for (int v = DUMMY; v <= TPX1; ++v) {
+		Version version = Version(v);
+		vector<string> expected_matrices(nb_chips);
+		vector<string> encoded(nb_chips);
+		reference_rate = run_encode(true, version, arrays, expected_matrices);
+		rate = run_encode(false, version, arrays, encoded);
+		same = expected_matrices == encoded;
+		print(json, first, "encode", version_name(version),
+		      reference_rate, rate, same);
+		all_same = all_same && same;
+	}
+	if (json)
+		cout << endl << "]}" << endl;
+	return all_same ? 0 : 1;
+}
@@ -0,0 +1,267 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2017
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+// Reconstruction benchmark on synthetic frames, no detector needed.
+//
+// usage: test_maxipix_reconstruction_bench [--json] [--frames n] [--threads n]
+//                                          [--roi x y width height]
+//                                          [--grid xchips ychips]
+//
+// For each layout, type, depth and in place / out of place it prints the
+// time per frame, the throughput (raw frame read + image written) and the
+// heap allocations per frame (operator new: the image buffers are
+// recycled, what remains is mostly the dimensions of the returned Data).
+#include <stdlib.h>
+#include <new>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+
+#include "MaxipixReconstruction.h"
+
+using namespace lima;
+using namespace lima::Maxipix;
+using namespace std;
+
+static long long nb_allocations = 0;
+
+void* operator new(size_t size)
+{
+	++nb_allocations;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+static const int NB_CHIP_PIXEL = 256 * 256;
+static const int GAP = 4;
+
+// L_GRID chips, a 3x1 module by default
+static int grid_xchips = 3;
+static int grid_ychips = 1;
+
+static const char* layout_name(MaxipixReconstruction::Layout layout)
+{
+	switch (layout) {
+	case MaxipixReconstruction::L_2x2: return "2x2";
+	case MaxipixReconstruction::L_5x1: return "5x1";
+	case MaxipixReconstruction::L_FREE: return "FREE";
+	case MaxipixReconstruction::L_GENERAL: return "GENERAL";
+	case MaxipixReconstruction::L_GRID: return "GRID";
+	default: return "NONE";
+	}
+}
+
+static const char* type_name(MaxipixReconstruction::Type type)
+{
+	switch (type) {
+	case MaxipixReconstruction::RAW: return "RAW";
+	case MaxipixReconstruction::ZERO: return "ZERO";
+	case MaxipixReconstruction::DISPATCH: return "DISPATCH";
+	default: return "MEAN";
+	}
+}
+
+// chips placed as on the usual modules: a line of 5 for L_FREE, a
+// rotated 2x2 square for L_GENERAL
+static void set_chips_position(MaxipixReconstruction& rec,
+			       MaxipixReconstruction::Layout layout)
+{
+	MaxipixReconstruction::PositionList chips;
+	MaxipixReconstruction::Position chip;
+	if (layout == MaxipixReconstruction::L_FREE) {
+		for (int i = 0; i < 5; ++i) {
+			chip.origin = Point(i * 256, 0);
+			chip.rotation = RotationMode(i % 4);
+			chips.push_back(chip);
+		}
+	} else if (layout == MaxipixReconstruction::L_GENERAL) {
+		chip.rotation = Rotation_270;
+		chip.origin = Point(0, 256 + GAP);
+		chips.push_back(chip);
+		chip.origin = Point(0, 0);
+		chips.push_back(chip);
+		chip.rotation = Rotation_90;
+		chip.origin = Point(256 + GAP, 0);
+		chips.push_back(chip);
+		chip.origin = Point(256 + GAP, 256 + GAP);
+		chips.push_back(chip);
+	} else
+		return;
+	rec.setChipsPosition(chips);
+}
+
+struct Result {
+	double ns_per_frame;
+	double gb_per_s;
+	double alloc_per_frame;
+};
+
+static Result run(MaxipixReconstruction::Layout layout,
+		  MaxipixReconstruction::Type type,
+		  int depth, bool in_place, int nb_frames, int nb_threads,
+		  const Roi& roi)
+{
+	MaxipixReconstruction *rec = new MaxipixReconstruction(layout, type);
+	rec->setXnYGapSpace(GAP, GAP);
+	set_chips_position(*rec, layout);
+	if (layout == MaxipixReconstruction::L_GRID)
+		rec->setChipsGrid(grid_xchips, grid_ychips);
+	rec->setNbThreads(nb_threads);
+	rec->setProcessingInPlace(in_place);
+
+	int nb_chips = layout == MaxipixReconstruction::L_5x1 ? 5 :
+		layout == MaxipixReconstruction::L_FREE ? 5 :
+		layout == MaxipixReconstruction::L_GRID ? grid_xchips * grid_ychips : 4;
+	Size full_size = rec->getImageSize();
+	if (roi.isActive())
+		rec->setOutputRoi(roi);
+	Size image_size = rec->getImageSize();
+	int raw_size = nb_chips * NB_CHIP_PIXEL * depth;
+	int image_bytes = image_size.getWidth() * image_size.getHeight() * depth;
+	int full_bytes = full_size.getWidth() * full_size.getHeight() * depth;
+
+	// in place, the acquisition buffer must hold the full image
+	Data raw;
+	raw.type = depth == 4 ? Data::INT32 : Data::UINT16;
+	raw.dimensions.push_back(image_size.getWidth());
+	raw.dimensions.push_back(image_size.getHeight());
+	Buffer *buffer = new Buffer(max(raw_size, full_bytes));
+	srand(1234);
+	if (depth == 4)
+		for (int i = 0; i < raw_size / 4; ++i)
+			((int*)buffer->data)[i] = rand() % 100000;
+	else
+		for (int i = 0; i < raw_size / 2; ++i)
+			((unsigned short*)buffer->data)[i] = rand() % 1000;
+	raw.setBuffer(buffer);
+	buffer->unref();
+
+	// warm up: output buffers pool and worker threads
+	for (int i = 0; i < 4; ++i)
+		Data image = rec->process(raw);
+
+	long long nb_alloc_start = nb_allocations;
+	double start = Timestamp::now();
+	for (int i = 0; i < nb_frames; ++i)
+		Data image = rec->process(raw);
+	double elapsed = double(Timestamp::now()) - start;
+	long long nb_alloc = nb_allocations - nb_alloc_start;
+
+	rec->unref();
+
+	Result result;
+	result.ns_per_frame = elapsed / nb_frames * 1e9;
+	result.gb_per_s = (double(raw_size) + image_bytes) * nb_frames / elapsed / 1e9;
+	result.alloc_per_frame = double(nb_alloc) / nb_frames;
+	return result;
+}
+
+int main(int argc, char *argv[])
+{
+	bool json = false;
+	int nb_frames = 1000;
+	int nb_threads = 1;
+	Roi roi;
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--json")
+			json = true;
+		else if (arg == "--frames" && i + 1 < argc)
+			nb_frames = atoi(argv[++i]);
+		else if (arg == "--threads" && i + 1 < argc)
+			nb_threads = atoi(argv[++i]);
+		else if (arg == "--roi" && i + 4 < argc) {
+			roi = Roi(atoi(argv[i + 1]), atoi(argv[i + 2]),
+				  atoi(argv[i + 3]), atoi(argv[i + 4]));
+			i += 4;
+		} else if (arg == "--grid" && i + 2 < argc) {
+			grid_xchips = atoi(argv[++i]);
+			grid_ychips = atoi(argv[++i]);
+		} else {
+			cerr << "usage: " << argv[0]
+			     << " [--json] [--frames n] [--threads n]"
+			     << " [--roi x y width height] [--grid xchips ychips]" << endl;
+			return 1;
+		}
+	}
+
+	MaxipixReconstruction::Layout layouts[] = {
+		MaxipixReconstruction::L_2x2, MaxipixReconstruction::L_5x1,
+		MaxipixReconstruction::L_FREE, MaxipixReconstruction::L_GENERAL,
+		MaxipixReconstruction::L_GRID
+	};
+	MaxipixReconstruction::Type types[] = {
+		MaxipixReconstruction::RAW, MaxipixReconstruction::ZERO,
+		MaxipixReconstruction::DISPATCH, MaxipixReconstruction::MEAN
+	};
+
+	if (json)
+		cout << "{\"frames\": " << nb_frames << ", \"threads\": " << nb_threads
+		     << ", \"gap\": " << GAP << ", \"grid\": \"" << grid_xchips << "x"
+		     << grid_ychips << "\", \"results\": [" << endl;
+	else
+		cout << setw(8) << "layout" << setw(10) << "type" << setw(6) << "depth"
+		     << setw(10) << "in_place" << setw(14) << "ns/frame"
+		     << setw(10) << "GB/s" << setw(14) << "alloc/frame" << endl;
+
+	bool first = true;
+	for (int l = 0; l < 5; ++l)
+		for (int t = 0; t < 4; ++t)
+			for (int depth = 2; depth <= 4; depth += 2)
+				for (int in_place = 0; in_place < 2; ++in_place) {
+					Result r = run(layouts[l], types[t], depth, in_place,
+						       nb_frames, nb_threads, roi);
+					if (json) {
+						if (!first)
+							cout << "," << endl;
+						cout << "  {\"layout\": \"" << layout_name(layouts[l])
+						     << "\", \"type\": \"" << type_name(types[t])
+						     << "\", \"depth\": " << depth
+						     << ", \"in_place\": " << (in_place ? "true" : "false")
+						     << ", \"ns_per_frame\": " << fixed << setprecision(0)
+						     << r.ns_per_frame
+						     << ", \"gb_per_s\": " << setprecision(3) << r.gb_per_s
+						     << ", \"alloc_per_frame\": " << setprecision(2)
+						     << r.alloc_per_frame << "}";
+					} else {
+						cout << setw(8) << layout_name(layouts[l])
+						     << setw(10) << type_name(types[t])
+						     << setw(6) << depth
+						     << setw(10) << (in_place ? "yes" : "no")
+						     << fixed << setprecision(0) << setw(14) << r.ns_per_frame
+						     << setprecision(3) << setw(10) << r.gb_per_s
+						     << setprecision(2) << setw(14) << r.alloc_per_frame
+						     << endl;
+					}
+					first = false;
+				}
+	if (json)
+		cout << endl << "]}" << endl;
+	return 0;
+}
@@ -0,0 +1,728 @@
+//###########################################################################
+// This file is part of LImA, a Library for Image Acquisition
+//
+// Copyright (C) : 2009-2017
+// European Synchrotron Radiation Facility
+// BP 220, Grenoble 38043
+// FRANCE
+//
+// This is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This software is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, see <http://www.gnu.org/licenses/>.
+//###########################################################################
+// Golden output regression test of the reconstruction kernels.
+//
+// usage: test_maxipix_reconstruction_regression [--record] [--verbose]
+//                                               [golden file]
+//
+// Every layout, type, depth, gap size and chip rotation is run on seeded
+// random and edge case frames. The image of the reference path (out of
+// place, one thread) is checked against the checksum of the golden file
+// (config/reconstruction_golden.txt by default), the other paths (in
+// place, worker threads, concatenated frames) must give the very same
+// bytes.
+//
+// The golden file has three sections:
+//   [baseline]   the images of the scalar code before the kernel rewrite
+//                (be5d8ff), for the cases it can run. Never re-recorded.
+//   [deltas]     the baseline cases changed on purpose: case, baseline
+//                checksum, new checksum. Only L_FREE (chips now rotated
+//                out of place) and the L_GENERAL gap fills may differ.
+//   [extensions] the cases the baseline can't run (L_GRID, float images,
+//                output roi and binning), recorded from the scalar kernels:
+//     MAXIPIX_SIMD=none test_maxipix_reconstruction_regression --record
+//                which rewrites this section only.
+// The file is then checked as is (vector kernels the CPU supports) and
+// with MAXIPIX_SIMD=none and MAXIPIX_SIMD=sse4.1.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "MaxipixReconstruction.h"
+
+using namespace lima;
+using namespace lima::Maxipix;
+using namespace std;
+
+static const int CHIP_SIZE = 256;
+static const int NB_CHIP_PIXEL = CHIP_SIZE * CHIP_SIZE;
+static const int NB_THREADS = 3;
+
+enum Pattern {
+	RANDOM, ZEROS, SATURATED, CHECKER, NB_PATTERN
+};
+
+static const char* pattern_name(int pattern)
+{
+	switch (pattern) {
+	case RANDOM: return "random";
+	case ZEROS: return "zeros";
+	case SATURATED: return "saturated";
+	default: return "checker";
+	}
+}
+
+static const char* layout_name(MaxipixReconstruction::Layout layout)
+{
+	switch (layout) {
+	case MaxipixReconstruction::L_2x2: return "2x2";
+	case MaxipixReconstruction::L_5x1: return "5x1";
+	case MaxipixReconstruction::L_FREE: return "FREE";
+	case MaxipixReconstruction::L_GRID: return "GRID";
+	default: return "GENERAL";
+	}
+}
+
+static const char* type_name(MaxipixReconstruction::Type type)
+{
+	switch (type) {
+	case MaxipixReconstruction::RAW: return "RAW";
+	case MaxipixReconstruction::ZERO: return "ZERO";
+	case MaxipixReconstruction::DISPATCH: return "DISPATCH";
+	default: return "MEAN";
+	}
+}
+
+struct Case {
+	MaxipixReconstruction::Layout layout;
+	MaxipixReconstruction::Type type;
+	int depth;
+	int xgap;
+	int ygap;
+	int rotation;		// of the first chip, L_FREE and L_GENERAL
+	int xchips;		// L_GRID
+	int ychips;
+	int pattern;
+	bool float_output;
+	bool output_stage;	// 2x2 binning of a roi
+	int small_roi;		// 1: across the first gaps, 2: in a chip
+
+	string name() const
+	{
+		ostringstream os;
+		os << layout_name(layout);
+		if (layout == MaxipixReconstruction::L_GRID)
+			os << xchips << "x" << ychips;
+		os << "_" << type_name(type)
+		   << "_d" << depth << "_g" << xgap << "x" << ygap
+		   << "_r" << rotation * 90 << "_" << pattern_name(pattern);
+		if (float_output)
+			os << "_float";
+		if (output_stage)
+			os << "_bin";
+		if (small_roi)
+			os << "_roi" << small_roi;
+		return os.str();
+	}
+
+	// DISPATCH gives (gap / 2) + 1 pixels to each chip, with an odd
+	// gap one pixel of the 5x1 and 2x2 images is never written: it
+	// keeps the raw pixel in place, the previous content of the
+	// buffer otherwise. Only out of place images are compared then.
+	bool has_unwritten_pixel() const
+	{
+		bool is_2x2 = same_layout() == MaxipixReconstruction::L_2x2;
+		return type == MaxipixReconstruction::DISPATCH &&
+			(layout == MaxipixReconstruction::L_5x1 || is_2x2 ||
+			 (layout == MaxipixReconstruction::L_GRID && ychips == 1)) &&
+			((xgap & 1) || (is_2x2 && (ygap & 1)));
+	}
+
+	// a 5x1 grid is reconstructed as L_5x1 and a 2x2 grid as L_2x2,
+	// from the same frame
+	MaxipixReconstruction::Layout same_layout() const
+	{
+		if (layout == MaxipixReconstruction::L_GRID) {
+			if (xchips == 5 && ychips == 1)
+				return MaxipixReconstruction::L_5x1;
+			if (xchips == 2 && ychips == 2)
+				return MaxipixReconstruction::L_2x2;
+		}
+		return layout;
+	}
+};
+
+// seeded generator, the frames must not depend on the libc rand()
+static unsigned int seed;
+
+static unsigned int next_random()
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static unsigned long long checksum(const Data& data)
+{
+	unsigned long long hash = 14695981039346656037ULL;	// FNV-1a
+	const unsigned char *p = (const unsigned char*) data.data();
+	for (int i = data.size(); i; --i, ++p) {
+		hash ^= *p;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static int nb_chips(const Case& c)
+{
+	if (c.layout == MaxipixReconstruction::L_GRID)
+		return c.xchips * c.ychips;
+	return c.layout == MaxipixReconstruction::L_5x1 ||
+		c.layout == MaxipixReconstruction::L_FREE ? 5 : 4;
+}
+
+// L_FREE: 5 chips shuffled in a line, L_GENERAL: 2x2 square, each chip
+// rotated a quarter more than the previous one
+static void set_chips_position(MaxipixReconstruction& rec, const Case& c)
+{
+	MaxipixReconstruction::PositionList chips;
+	MaxipixReconstruction::Position chip;
+	for (int i = 0; i < nb_chips(c); ++i) {
+		if (c.layout == MaxipixReconstruction::L_FREE)
+			chip.origin = Point((i * 3) % 5 * CHIP_SIZE, 0);
+		else
+			chip.origin = Point((i % 2) * (CHIP_SIZE + c.xgap),
+					    (i / 2) * (CHIP_SIZE + c.ygap));
+		chip.rotation = RotationMode((c.rotation + i) % 4);
+		chips.push_back(chip);
+	}
+	rec.setChipsPosition(chips);
+}
+
+// full_size: the image before the output roi and binning
+static MaxipixReconstruction* create(const Case& c, bool in_place, int nb_threads,
+				     Size& full_size)
+{
+	MaxipixReconstruction *rec = new MaxipixReconstruction(c.layout, c.type);
+	rec->setXnYGapSpace(c.xgap, c.ygap);
+	if (c.layout == MaxipixReconstruction::L_GRID)
+		rec->setChipsGrid(c.xchips, c.ychips);
+	if (c.layout == MaxipixReconstruction::L_FREE ||
+	    c.layout == MaxipixReconstruction::L_GENERAL)
+		set_chips_position(*rec, c);
+	rec->setFloatOutput(c.float_output);
+	full_size = rec->getImageSize();
+	if (c.output_stage) {
+		rec->setOutputRoi(Roi(Point(3, 5), Size(full_size.getWidth() - 7,
+							full_size.getHeight() - 6)));
+		rec->setOutputBin(Bin(2, 2));
+	} else if (c.small_roi) {
+		Size size(23, 29);
+		Point origin = c.small_roi == 1 ?
+			Point(CHIP_SIZE - 6, CHIP_SIZE - 11) : Point(37, 90);
+		origin.y = min(origin.y, full_size.getHeight() - size.getHeight());
+		rec->setOutputRoi(Roi(origin, size));
+	}
+	rec->setNbThreads(nb_threads);
+	rec->setProcessingInPlace(in_place);
+	return rec;
+}
+
+// the raw frame with the full image dimensions, as the acquisition
+// buffers are sized from the image before the output roi and binning
+static Data make_frame(const Case& c, const Size& full_size)
+{
+	int nb_pixel = nb_chips(c) * NB_CHIP_PIXEL;
+	int nb_image_pixel = full_size.getWidth() * full_size.getHeight();
+	Data raw;
+	raw.type = c.depth == 4 ? Data::INT32 : Data::UINT16;
+	raw.dimensions.push_back(full_size.getWidth());
+	raw.dimensions.push_back(full_size.getHeight());
+	Buffer *buffer = new Buffer(max(nb_pixel, nb_image_pixel) * c.depth);
+	raw.setBuffer(buffer);
+	buffer->unref();
+
+	// 32 bits: accumulation counts, kept exact in float
+	unsigned int max_value = c.depth == 4 ? 0x7fffff80 : 0xffff;
+	int layout = c.same_layout();
+	seed = 0x9e3779b9u ^ (layout << 24) ^ (c.type << 20) ^
+		(c.depth << 16) ^ (c.xgap << 8) ^ c.ygap;
+	for (int i = 0; i < nb_pixel; ++i) {
+		unsigned int value;
+		switch (c.pattern) {
+		case RANDOM: value = next_random() % (max_value + 1); break;
+		case ZEROS: value = 0; break;
+		case SATURATED: value = max_value; break;
+		default: value = ((i + i / CHIP_SIZE) & 1) ? max_value : 0; break;
+		}
+		if (c.depth == 4)
+			((int*) raw.data())[i] = int(value);
+		else
+			((unsigned short*) raw.data())[i] = (unsigned short) value;
+	}
+	return raw;
+}
+
+static Data run(const Case& c, bool in_place, int nb_threads)
+{
+	Size full_size;
+	MaxipixReconstruction *rec = create(c, in_place, nb_threads, full_size);
+	Data raw = make_frame(c, full_size);
+	Data image = rec->process(raw);
+	rec->unref();
+	return image;
+}
+
+static bool same_image(const Data& a, const Data& b)
+{
+	return a.type == b.type && a.dimensions == b.dimensions &&
+		!memcmp(a.data(), b.data(), a.size());
+}
+
+// recycled output buffers: a task first set to another type writes its
+// image over a buffer filled with garbage, gives it back to its pool and
+// switches to the case type. The next images, in recycled buffers
+// scribbled over the same way, must be the reference one.
+static bool run_recycled(const Case& c, const Data& reference)
+{
+	Case other = c;
+	other.type = c.type == MaxipixReconstruction::DISPATCH ?
+		MaxipixReconstruction::MEAN : MaxipixReconstruction::DISPATCH;
+	Size full_size;
+	MaxipixReconstruction *rec = create(other, false, 1, full_size);
+	Data raw = make_frame(c, full_size);
+	bool same = true;
+	for (int i = 0; i < 3; ++i) {
+		Data image = rec->process(raw);
+		if (i)
+			same = same && same_image(image, reference);
+		memset(image.data(), 0xa5, image.size());
+		if (!i)
+			rec->setType(c.type);
+	}
+	rec->unref();
+	return same;
+}
+
+// the same frame concatenated NB_BATCH_FRAMES times, every plane of the
+// batch must be the reference image
+static const int NB_BATCH_FRAMES = 3;
+
+static bool run_batch(const Case& c, bool in_place, const Data& reference)
+{
+	Size full_size;
+	MaxipixReconstruction *rec = create(c, in_place, 1, full_size);
+	Data raw = make_frame(c, full_size);
+	int frame_size = raw.size();
+	Data frames = raw;
+	Buffer *buffer = new Buffer(frame_size * NB_BATCH_FRAMES);
+	for (int i = 0; i < NB_BATCH_FRAMES; ++i)
+		memcpy((char*) buffer->data + i * frame_size, raw.data(), frame_size);
+	frames.setBuffer(buffer);
+	buffer->unref();
+
+	Data images = rec->processFrames(frames, NB_BATCH_FRAMES);
+	rec->unref();
+
+	bool same = images.type == reference.type &&
+		images.dimensions.size() == 3 &&
+		images.dimensions[0] == reference.dimensions[0] &&
+		images.dimensions[1] == reference.dimensions[1] &&
+		images.dimensions[2] == NB_BATCH_FRAMES;
+	for (int i = 0; same && i < NB_BATCH_FRAMES; ++i)
+		same = !memcmp((char*) images.data() + i * reference.size(),
+			       reference.data(), reference.size());
+	return same;
+}
+
+// a 5x1 frame the task must refuse to process
+static bool rejects_frame(const Case& c, const Data& raw)
+{
+	Size full_size;
+	MaxipixReconstruction *rec = create(c, false, 1, full_size);
+	bool rejected = false;
+	try {
+		Data copy = raw;
+		rec->process(copy);
+	} catch (Exception&) {
+		rejected = true;
+	}
+	rec->unref();
+	return rejected;
+}
+
+static Case frame_check_case()
+{
+	Case c;
+	c.layout = MaxipixReconstruction::L_5x1;
+	c.type = MaxipixReconstruction::MEAN;
+	c.depth = 2;
+	c.xgap = 4;
+	c.ygap = 0;
+	c.rotation = 0;
+	c.xchips = c.ychips = 1;
+	c.pattern = RANDOM;
+	c.float_output = false;
+	c.output_stage = false;
+	c.small_roi = 0;
+	return c;
+}
+
+// the raw frames are 16 or 32 bit counters, float is only the type of
+// the images given out: a raw frame labelled FLOAT must be rejected, not
+// read as 32 bit counters
+static bool rejects_float_frame()
+{
+	Case c = frame_check_case();
+	c.depth = 4;
+	c.float_output = true;
+	Size full_size;
+	MaxipixReconstruction *rec = create(c, false, 1, full_size);
+	rec->unref();
+	Data raw = make_frame(c, full_size);
+	raw.type = Data::FLOAT;
+	return rejects_frame(c, raw);
+}
+
+// a frame sized from the binned output image can't hold the raw chips
+static bool rejects_short_frame()
+{
+	Case c = frame_check_case();
+	c.output_stage = true;
+	Size full_size;
+	MaxipixReconstruction *rec = create(c, false, 1, full_size);
+	Size image_size = rec->getImageSize();
+	rec->unref();
+	Data raw = make_frame(c, full_size);
+	raw.dimensions[0] = image_size.getWidth();
+	raw.dimensions[1] = image_size.getHeight();
+	return rejects_frame(c, raw);
+}
+
+static void add_cases(vector<Case>& cases, Case c)
+{
+	for (c.depth = 2; c.depth <= 4; c.depth += 2)
+		for (int t = 0; t < 4; ++t) {
+			c.type = MaxipixReconstruction::Type(t);
+			for (c.pattern = 0; c.pattern < NB_PATTERN; ++c.pattern) {
+				c.float_output = false;
+				cases.push_back(c);
+				c.float_output = true;
+				cases.push_back(c);
+			}
+		}
+}
+
+static vector<Case> all_cases()
+{
+	vector<Case> cases;
+	Case c;
+	c.rotation = 0;
+	c.xchips = c.ychips = 1;
+	c.output_stage = false;
+	c.small_roi = 0;
+
+	// around the vector kernels gap window
+	static const int gaps_5x1[] = {0, 1, 2, 3, 4, 5, 6, 7, 9, 12};
+	c.layout = MaxipixReconstruction::L_5x1;
+	c.ygap = 0;
+	for (int i = 0; i < int(sizeof(gaps_5x1) / sizeof(int)); ++i) {
+		c.xgap = gaps_5x1[i];
+		add_cases(cases, c);
+	}
+
+	static const int gaps_2x2[][2] = {{0, 0}, {1, 1}, {2, 2}, {4, 4},
+					  {5, 3}, {3, 6}, {8, 7}};
+	c.layout = MaxipixReconstruction::L_2x2;
+	for (int i = 0; i < int(sizeof(gaps_2x2) / sizeof(gaps_2x2[0])); ++i) {
+		c.xgap = gaps_2x2[i][0];
+		c.ygap = gaps_2x2[i][1];
+		add_cases(cases, c);
+	}
+
+	static const int gaps_general[][2] = {{0, 0}, {1, 2}, {4, 4}, {5, 3}};
+	c.layout = MaxipixReconstruction::L_GENERAL;
+	for (int i = 0; i < int(sizeof(gaps_general) / sizeof(gaps_general[0])); ++i)
+		for (c.rotation = 0; c.rotation < 4; ++c.rotation) {
+			c.xgap = gaps_general[i][0];
+			c.ygap = gaps_general[i][1];
+			add_cases(cases, c);
+		}
+
+	// no gap between L_FREE chips
+	c.layout = MaxipixReconstruction::L_FREE;
+	c.xgap = c.ygap = 0;
+	for (c.rotation = 0; c.rotation < 4; ++c.rotation)
+		add_cases(cases, c);
+
+	// output roi and binning, fused with the 5x1 kernels
+	c.rotation = 0;
+	c.output_stage = true;
+	static const MaxipixReconstruction::Layout layouts[] = {
+		MaxipixReconstruction::L_5x1, MaxipixReconstruction::L_2x2,
+		MaxipixReconstruction::L_GENERAL
+	};
+	for (int i = 0; i < 3; ++i)
+		for (c.xgap = 2; c.xgap <= 4; c.xgap += 2) {
+			c.layout = layouts[i];
+			c.ygap = c.xgap;
+			add_cases(cases, c);
+		}
+
+	// small rois, only the part of the image they need is reconstructed
+	c.output_stage = false;
+	static const MaxipixReconstruction::Layout roi_layouts[] = {
+		MaxipixReconstruction::L_5x1, MaxipixReconstruction::L_2x2,
+		MaxipixReconstruction::L_GENERAL, MaxipixReconstruction::L_FREE
+	};
+	for (c.small_roi = 1; c.small_roi <= 2; ++c.small_roi)
+		for (int i = 0; i < 4; ++i) {
+			c.layout = roi_layouts[i];
+			c.xgap = c.ygap =
+				c.layout == MaxipixReconstruction::L_FREE ? 0 : 2;
+			add_cases(cases, c);
+		}
+
+	// regular grids: single lines by the 5x1 kernels, 2x2 by the 2x2
+	// ones, the others by the L_GENERAL remap and gap fills. In place,
+	// 2x6 needs more than a chip of saved lines: raw chips copied aside
+	// {xchips, ychips, xgap, ygap}
+	static const int grids[][4] = {{2, 1, 3, 0}, {3, 1, 0, 0}, {4, 1, 2, 0},
+				       {5, 1, 2, 0}, {2, 2, 4, 4}, {3, 2, 2, 2},
+				       {2, 3, 5, 3}, {2, 6, 4, 4}};
+	c.layout = MaxipixReconstruction::L_GRID;
+	c.small_roi = 0;
+	for (int i = 0; i < int(sizeof(grids) / sizeof(grids[0])); ++i) {
+		c.xchips = grids[i][0];
+		c.ychips = grids[i][1];
+		c.xgap = grids[i][2];
+		c.ygap = grids[i][3];
+		add_cases(cases, c);
+	}
+	// output stage and small rois of a line and of a 2 lines grid
+	static const int roi_grids[][2] = {{4, 1}, {3, 2}};
+	c.xgap = c.ygap = 2;
+	for (int i = 0; i < 2; ++i) {
+		c.xchips = roi_grids[i][0];
+		c.ychips = roi_grids[i][1];
+		c.output_stage = true;
+		add_cases(cases, c);
+		c.output_stage = false;
+		for (c.small_roi = 1; c.small_roi <= 2; ++c.small_roi)
+			add_cases(cases, c);
+		c.small_roi = 0;
+	}
+	return cases;
+}
+
+// cases the scalar code before the kernel rewrite could already run
+static bool in_baseline(const Case& c)
+{
+	return c.layout != MaxipixReconstruction::L_GRID && !c.float_output &&
+		!c.output_stage && !c.small_roi;
+}
+
+// the changes of the rewrite: L_FREE chips are rotated out of place too,
+// the baseline gave the raw frame back, and the L_GENERAL gaps are
+// filled as the type asks, the baseline left them at 0
+static bool is_expected_delta(const Case& c)
+{
+	return c.layout == MaxipixReconstruction::L_FREE ||
+		(c.layout == MaxipixReconstruction::L_GENERAL &&
+		 c.type != MaxipixReconstruction::RAW);
+}
+
+struct Golden {
+	map<string, unsigned long long> baseline;
+	map<string, unsigned long long> deltas;
+	map<string, unsigned long long> extensions;
+	vector<string> head;	// the file up to [extensions], kept by --record
+
+	// the checksum a case must give, false if there is none
+	bool find(const Case& c, unsigned long long& hash) const
+	{
+		const map<string, unsigned long long>& section =
+			!in_baseline(c) ? extensions :
+			deltas.count(c.name()) ? deltas : baseline;
+		map<string, unsigned long long>::const_iterator i =
+			section.find(c.name());
+		if (i == section.end())
+			return false;
+		hash = i->second;
+		return true;
+	}
+};
+
+static bool read_golden(const string& file_name, Golden& golden,
+			vector<string>& errors)
+{
+	ifstream file(file_name.c_str());
+	if (!file)
+		return false;
+	map<string, unsigned long long> *section = NULL;
+	string line;
+	while (getline(file, line)) {
+		if (line == "[extensions]")
+			section = &golden.extensions;
+		if (section != &golden.extensions)
+			golden.head.push_back(line);
+		if (line == "[baseline]")
+			section = &golden.baseline;
+		else if (line == "[deltas]")
+			section = &golden.deltas;
+		if (!section || line.empty() || line[0] == '#' || line[0] == '[')
+			continue;
+		istringstream is(line);
+		string name;
+		unsigned long long hash, new_hash;
+		if (!(is >> name >> hex >> hash))
+			continue;
+		if (section != &golden.deltas) {
+			(*section)[name] = hash;
+			continue;
+		}
+		// a delta restates the baseline checksum it replaces
+		if (!(is >> new_hash) || new_hash == hash)
+			errors.push_back(name + ": delta without a new checksum");
+		else if (!golden.baseline.count(name) ||
+			 golden.baseline[name] != hash)
+			errors.push_back(name + ": delta of another baseline checksum");
+		golden.deltas[name] = new_hash;
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	bool record = false;
+	bool verbose = false;
+	string file_name = "config/reconstruction_golden.txt";
+	for (int i = 1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "--record")
+			record = true;
+		else if (arg == "--verbose")
+			verbose = true;
+		else if (arg[0] != '-')
+			file_name = arg;
+		else {
+			cerr << "usage: " << argv[0]
+			     << " [--record] [--verbose] [golden file]" << endl;
+			return 1;
+		}
+	}
+
+	vector<Case> cases = all_cases();
+	Golden golden;
+	vector<string> errors;
+	if (!read_golden(file_name, golden, errors)) {
+		cerr << "can't read " << file_name << endl;
+		return 1;
+	}
+	// the baseline and the deltas are kept, the extensions recorded
+	ofstream out;
+	if (record) {
+		out.open(file_name.c_str());
+		if (!out) {
+			cerr << "can't write " << file_name << endl;
+			return 1;
+		}
+		for (vector<string>::iterator l = golden.head.begin();
+		     l != golden.head.end(); ++l)
+			out << *l << endl;
+		out << "[extensions]" << endl;
+	}
+
+	int nb_failed = 0;
+	int nb_checks = 0;
+	for (vector<string>::iterator e = errors.begin(); e != errors.end(); ++e)
+		cout << "FAILED " << *e << endl;
+	nb_failed += errors.size();
+	for (vector<Case>::const_iterator i = cases.begin(); i != cases.end(); ++i) {
+		const Case& c = *i;
+		string name = c.name();
+		if (record && in_baseline(c))
+			continue;
+		Data reference = run(c, false, 1);
+		unsigned long long hash = checksum(reference);
+		if (record) {
+			char hex_hash[17];
+			snprintf(hex_hash, sizeof(hex_hash), "%016llx", hash);
+			out << name << " " << hex_hash << endl;
+			++nb_checks;
+			continue;
+		}
+
+		vector<string> failed;
+		unsigned long long golden_hash;
+		if (!golden.find(c, golden_hash))
+			failed.push_back("not in golden file");
+		else if (golden_hash != hash)
+			failed.push_back("reference");
+		if (golden.deltas.count(name) && !is_expected_delta(c))
+			failed.push_back("unexpected delta from the baseline");
+		++nb_checks;
+		if (c.same_layout() != c.layout) {
+			Case fixed = c;
+			fixed.layout = c.same_layout();
+			if (!golden.find(fixed, golden_hash) || golden_hash != hash)
+				failed.push_back("not as " + fixed.name());
+			++nb_checks;
+		}
+
+		if (!same_image(run(c, false, NB_THREADS), reference))
+			failed.push_back("threads");
+		++nb_checks;
+		if (!run_recycled(c, reference))
+			failed.push_back("recycled buffers");
+		++nb_checks;
+		if (!c.has_unwritten_pixel()) {
+			if (!same_image(run(c, true, 1), reference))
+				failed.push_back("in place");
+			if (!same_image(run(c, true, NB_THREADS), reference))
+				failed.push_back("in place threads");
+			nb_checks += 2;
+		}
+		// with an output stage the images are smaller than the frames,
+		// packed at the start of the batch in place
+		if (!run_batch(c, false, reference))
+			failed.push_back("batch");
+		++nb_checks;
+		if (!c.has_unwritten_pixel()) {
+			if (!run_batch(c, true, reference))
+				failed.push_back("batch in place");
+			++nb_checks;
+		}
+
+		for (vector<string>::iterator f = failed.begin(); f != failed.end(); ++f)
+			cout << "FAILED " << name << ": " << *f << endl;
+		nb_failed += failed.size();
+		if (verbose && failed.empty())
+			cout << "ok " << name << endl;
+	}
+
+	if (record) {
+		cout << nb_checks << " extension cases recorded in "
+		     << file_name << endl;
+		return 0;
+	}
+
+	if (!rejects_float_frame()) {
+		cout << "FAILED float raw frame accepted" << endl;
+		++nb_failed;
+	}
+	if (!rejects_short_frame()) {
+		cout << "FAILED frame smaller than the raw chips accepted" << endl;
+		++nb_failed;
+	}
+	nb_checks += 2;
+	cout << nb_checks - nb_failed << "/" << nb_checks << " checks passed, "
+	     << cases.size() << " cases" << endl;
+	return nb_failed ? 1 : 0;
+}